@@ -101,12 +101,26 @@ void GeneratorCONF::writeData(Cladogram * clad, OutputFile & out) {
     << "\n# 1 = forbid overlaps, 0 = allow overlaps (better optimisation)"
     << "\nstrictOverlaps = " << clad->strictOverlaps
     << "\n"
+    << "\n# Pack isolated nodes into as few lines as possible, instead of what"
+    << "\n# the first digit of optimise says. 1 = pack, 0 = don't"
+    << "\npackSingleRoots = " << clad->packSingleRoots
+    << "\n"
     << "\n# How much space (in offsets) to add before/after trees"
     << "\ntreeSpacing = " << clad->treeSpacing
     << "\n"
     << "\n# How big (total children) a tree has to be before it gets spaced"
     << "\ntreeSpacingBiggerThan = " << clad->treeSpacingBiggerThan
     << "\n"
+    << "\n# Store the layout in this file and reuse it as long as the data and"
+    << "\n# the layout options don't change. Otherwise trees which didn't"
+    << "\n# change keep their layout. Leave empty to disable."
+    << "\nlayoutCache = " << clad->layoutCache
+    << "\n"
+    << "\n# Start no optimisation pass after this many milliseconds, cheapest"
+    << "\n# passes first, and report how far it got and how long it took."
+    << "\n# 0 = no limit"
+    << "\noptimiseBudgetMs = " << clad->optimiseBudgetMs
+    << "\n"
     << "\n# Background color in hexadecimal RGB (#abc or #abcdef)"
     << "\nmainBackground = #" << clad->mainBackground.hex
     << "\n"
@@ -96,7 +96,7 @@ void GeneratorCSV::writeData(Cladogram * clad, OutputFile & out) {
       stopdate = "";                           // set empty stop date
 
     f << "\"N\",\"" << n->name << "\",\"#" << n->color.hex << "\",\"" 
-      << n->parentName << "\",\""
+      << clad->symbols.name(n->parentId) << "\",\""
       << Date2str(n->start) << "\",\"" << stopdate << "\",\""
       << n->iconfile << "\",\"" << n->description << "\"";
 
@@ -125,8 +125,8 @@ void GeneratorCSV::writeData(Cladogram * clad, OutputFile & out) {
     if( !(fromWhen < toWhen) && !(toWhen < fromWhen) )  // if they are equal
       toWhen = "";                                      // set empty toWhen date
 
-    f << "\"C\",\"" << fromWhen << "\",\"" << c->fromName << "\",\""
-      << toWhen << "\",\"" << c->toName << "\",\""
+    f << "\"C\",\"" << fromWhen << "\",\"" << clad->symbols.name(c->fromId)
+      << "\",\"" << toWhen << "\",\"" << clad->symbols.name(c->toId) << "\",\""
       << int2str(c->thickness) << "\",\"#" << c->color.hex << "\""
       << tailC << "\n";
     
@@ -142,7 +142,7 @@ void GeneratorCSV::writeData(Cladogram * clad, OutputFile & out) {
 
     d = clad->domains[i];
 
-    f << "\"D\",\"" << d->nodeName << "\",\"#" << d->color.hex
+    f << "\"D\",\"" << clad->symbols.name(d->nodeId) << "\",\"#" << d->color.hex
       << "\",\"" << int2str(d->intensity) << "\"" << tailD << "\n";
   }
 
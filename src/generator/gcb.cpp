@@ -0,0 +1,150 @@
+/*
+*  gcb.cpp - implements a binary dataset generator for gnuclad
+*
+*  Copyright (C) 2010-2011 Donjan Rodic <donjan@dyx.ch>
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gcb.h"
+
+using namespace std;
+
+
+GeneratorGCB::GeneratorGCB() {}
+GeneratorGCB::~GeneratorGCB() {}
+
+// The dataset is stored as parsed: compute() drops and reorders nodes,
+// completes dates and prefixes file names, which would be done twice when
+// the file is read back.
+void GeneratorGCB::keepParsedData(Cladogram * clad) {
+
+  // The records are written as they are read back, see gnuclad.h for the
+  // layout. The strings are collected first, the records refer to them by id.
+  SymbolTable strings;
+  records.clear();
+  int nameChangeCount = 0;
+
+  Node * n;
+  Connector * c;
+  Domain * d;
+  Image * im;
+
+  // Nodes
+  vector<char> nameChanges;
+  for(int i = 0; i < (int)clad->nodes.size(); ++i) {
+
+    n = clad->nodes[i];
+
+    putInt32(records, strings.intern(n->name));
+    putInt32(records, strings.intern(n->parentName));
+    putInt32(records, packColor(n->color));
+    putInt32(records, packDate(n->start));
+    putInt32(records, packDate(n->stop));
+    putInt32(records, strings.intern(n->iconfile));
+    putInt32(records, strings.intern(n->description));
+    putInt32(records, nameChangeCount);
+    putInt32(records, n->nameChanges.size());
+
+    for(int j = 0; j < (int)n->nameChanges.size(); ++j) {
+      NameChange * nc = &(n->nameChanges[j]);
+      putInt32(nameChanges, strings.intern(nc->newName));
+      putInt32(nameChanges, packDate(nc->date));
+      putInt32(nameChanges, strings.intern(nc->description));
+      ++nameChangeCount;
+    }
+  }
+  records.insert(records.end(), nameChanges.begin(), nameChanges.end());
+
+  // Connectors
+  for(int i = 0; i < (int)clad->connectors.size(); ++i) {
+
+    c = clad->connectors[i];
+
+    putInt32(records, packDate(c->fromWhen));
+    putInt32(records, strings.intern(c->fromName));
+    putInt32(records, packDate(c->toWhen));
+    putInt32(records, strings.intern(c->toName));
+    putInt32(records, c->thickness);
+    putInt32(records, packColor(c->color));
+  }
+
+  // Domains
+  for(int i = 0; i < (int)clad->domains.size(); ++i) {
+
+    d = clad->domains[i];
+
+    putInt32(records, strings.intern(d->nodeName));
+    putInt32(records, packColor(d->color));
+    putInt32(records, d->intensity);
+  }
+
+  // Images
+  for(int i = 0; i < (int)clad->includeSVG.size(); ++i) {
+
+    im = clad->includeSVG[i];
+
+    putInt32(records, strings.intern(im->filename));
+    putInt32(records, im->x);
+    putInt32(records, im->y);
+  }
+  for(int i = 0; i < (int)clad->includePNG.size(); ++i) {
+
+    im = clad->includePNG[i];
+
+    putInt32(records, strings.intern(im->filename));
+    putInt32(records, im->x);
+    putInt32(records, im->y);
+  }
+
+
+  // Header and string table
+  head.clear();
+  bytes.clear();
+  offsets.clear();
+  for(int i = 0; i < strings.size(); ++i) {
+    putInt32(offsets, bytes.size());
+    const string &s = strings.name(i);
+    bytes.insert(bytes.end(), s.begin(), s.end());
+  }
+  putInt32(offsets, bytes.size());
+  int byteCount = bytes.size();
+  bytes.resize((bytes.size() + 3) / 4 * 4, '\0');
+
+  putInt32(head, gcbMagic);
+  putInt32(head, gcbVersion);
+  putInt32(head, strings.size());
+  putInt32(head, byteCount);
+  putInt32(head, clad->nodes.size());
+  putInt32(head, nameChangeCount);
+  putInt32(head, clad->connectors.size());
+  putInt32(head, clad->domains.size());
+  putInt32(head, clad->includeSVG.size());
+  putInt32(head, clad->includePNG.size());
+}
+
+// Writes the data kept by keepParsedData(), once compute() has checked it
+void GeneratorGCB::writeData(Cladogram *, OutputFile & out) {
+
+  // The file has been opened in text mode, which could mangle the bytes
+  ofstream & f = *(out.p);
+  f.close();
+  f.open(out.name.c_str(), ios::out | ios::binary | ios::trunc);
+  if(!f.is_open()) throw "failed to open file " + out.name;
+
+  f.write(&head[0], head.size());
+  f.write(&offsets[0], offsets.size());
+  if(bytes.size() > 0) f.write(&bytes[0], bytes.size());
+  if(records.size() > 0) f.write(&records[0], records.size());
+}
@@ -0,0 +1,43 @@
+/*
+*  gcb.h - binary dataset generator header for gnuclad
+*
+*  Copyright (C) 2010-2011 Donjan Rodic <donjan@dyx.ch>
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef GENERATORGCB_H_
+#define GENERATORGCB_H_
+
+#include "../gnuclad.h"
+
+
+class GeneratorGCB: public Generator {
+  public:
+
+  GeneratorGCB();
+  ~GeneratorGCB();
+  void keepParsedData(Cladogram * clad);
+  void writeData(Cladogram * clad, OutputFile & out);
+
+  private:
+  std::vector<char> head;
+  std::vector<char> offsets;
+  std::vector<char> bytes;
+  std::vector<char> records;
+};
+
+
+#endif
@@ -128,7 +128,7 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
   // Domain gradients
   for(int i = 0; i < (int)clad->domains.size(); ++i) {
     Domain * d = clad->domains[i];
-    f << "  <linearGradient id='__domain_" << validxml(d->nodeName, true) << "' x1='0' y1='0' x2='1' y2='0'>\n"
+    f << "  <linearGradient id='__domain_" << validxml(clad->symbols.name(d->nodeId), true) << "' x1='0' y1='0' x2='1' y2='0'>\n"
       << "    <stop stop-color='#" << d->color.hex << "' offset='0' stop-opacity='0' />\n"
       << "    <stop stop-color='#" << d->color.hex << "' offset='1' stop-opacity='" << float(d->intensity) / 100 << "' />\n"
       << "  </linearGradient>\n";
@@ -156,11 +156,11 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
     n = clad->nodes[i];
     if(n->stop < clad->endOfTime) {
       string name = validxml(n->name, true);
-      f << "  <linearGradient id='__fadeout_" << name << "' x1='0' y1='0' x2='" << fade / (1 + (sqrt(n->size)-1) * clad->bigParent) << "' y2='0' gradientUnits='userSpaceOnUse'>\n"
+      f << "  <linearGradient id='__fadeout_" << name << "' x1='0' y1='0' x2='" << fade / (1 + n->lineGrowth) << "' y2='0' gradientUnits='userSpaceOnUse'>\n"
         << "    <stop stop-color='#" << n->color.hex << "' offset='0' stop-opacity='1' />\n"
         << "    <stop stop-color='#" << n->color.hex << "' offset='1' stop-opacity='0' />\n"
         << "  </linearGradient>\n"
-        << "  <marker id='__stop_" << name << "' markerWidth='" << fade / (1 + (sqrt(n->size)-1) * clad->bigParent) << "' markerHeight='1' style='overflow:visible;'>\n"
+        << "  <marker id='__stop_" << name << "' markerWidth='" << fade / (1 + n->lineGrowth) << "' markerHeight='1' style='overflow:visible;'>\n"
         << "    <use xlink:href='#__fadeout' style='fill:url(#__fadeout_" << name << ")' />\n"
         << "  </marker>\n";
     }
@@ -246,7 +246,7 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
       hval -= oPX;
     }
     f << "  <rect x='" << xpos << "' y='" << yval << "' width='" << wval << "' height='" << hval
-      << "' rx='" << oPX / 2 << "' ry='" << oPX / 2 << "' fill='url(#__domain_" << validxml(d->nodeName, true) << ")' />\n";
+      << "' rx='" << oPX / 2 << "' ry='" << oPX / 2 << "' fill='url(#__domain_" << validxml(clad->symbols.name(d->nodeId), true) << ")' />\n";
 
   }
 
@@ -298,7 +298,7 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
       else sign = -1;
       int posYparent = n->parent->offset * oPX + topOffset;
       if(dType < 1 || 5 < dType)
-        posYparent -= sign * int((lPX * (1 + (sqrt(n->parent->size)-1) * clad->bigParent))/2);
+        posYparent -= sign * int((lPX * (1 + n->parent->lineGrowth))/2);
 
       if(dType == 0)
         f << startX << " " << posYparent << " L ";
@@ -335,7 +335,7 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
     f << startX << " " << posY << " L " << stopX << " " << posY
       << "' stroke='#"<< n->color.hex << "'";
 //~ f << " style='stroke-width:" << lPX * (1 + (sqrt(n->size-1)) * clad->bigParent) << ";'";  // is more "exact"
-    f << " style='stroke-width:" << lPX * (1 + (sqrt(n->size)-1) * clad->bigParent) << ";'";  // looks better
+    f << " style='stroke-width:" << lPX * (1 + n->lineGrowth) << ";'";  // looks better
     if(n->stop < clad->endOfTime && clad->stopFadeOutPX != 0)
       f << " marker-end='url(#__stop_" << validxml(n->name, true) << ")'";
     f << " />\n";
@@ -431,7 +431,7 @@ void GeneratorSVG::writeData(Cladogram * clad, OutputFile & out) {
     }
 
     int posX = datePX(n->start, clad) + xPX + clad->dotRadius;
-    int posY = n->offset * oPX + topOffset - dirty_hack_ex/2 - int(lPX*((sqrt(n->size)-1) * clad->bigParent)/2);
+    int posY = n->offset * oPX + topOffset - dirty_hack_ex/2 - int(lPX*(n->lineGrowth)/2);
     int posXwName = posX + strlenpx(n->name, clad) + dirty_hack_em;  // + dirty_hack_em is experimental
     int alignmentBGx = posX - dirty_hack_em/4;
     string alignment = "";
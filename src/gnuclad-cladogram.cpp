@@ -22,6 +22,12 @@
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <limits>
+#include <queue>
+
+#ifdef GNUCLAD_POSIX
+#include <pthread.h>
+#endif
 
 using namespace std;
 
@@ -32,6 +38,7 @@ Cladogram::Cladogram() {
   truncateFolder = false;
   inVitro = false;
   tighterDomains = false;
+  jobs = 1;
 
   endOfTime = currentDate();
   beginningOfTime = endOfTime;
@@ -53,6 +60,11 @@ Cladogram::Cladogram() {
   infoBoxHeight = 60;
 
   slice = "";
+  layoutCache = "";
+  optimiseBudgetMs = 0;
+  optimiseDeadline = 0;
+  passesDone = 0;
+  passesTotal = 0;
 
   fontCorrectionFactor = 1.0;
   orientation = 0;
@@ -60,6 +72,7 @@ Cladogram::Cladogram() {
   sortKey = 0;
   optimise = 99;
   strictOverlaps = 0;
+  packSingleRoots = 0;
   treeSpacing = 1;
   treeSpacingBiggerThan = 5;
 
@@ -116,20 +129,27 @@ Cladogram::Cladogram() {
 
 }
 
-Cladogram::~Cladogram() {
-  for(int i = 0; i < (int)nodes.size(); ++i)
-    if(nodes[i] != NULL) delete nodes[i];
-  for(int i = 0; i < (int)connectors.size(); ++i)
-    if(connectors[i] != NULL) delete connectors[i];
-  for(int i = 0; i < (int)domains.size(); ++i)
-    if(domains[i] != NULL) delete domains[i];
+// Nodes, connectors, domains and images are released with their pools
+Cladogram::~Cladogram() {}
 
-  for(int i = 0; i < (int)includeSVG.size(); ++i)
-    if(includeSVG[i] != NULL) delete includeSVG[i];
-  for(int i = 0; i < (int)includePNG.size(); ++i)
-    if(includePNG[i] != NULL) delete includePNG[i];
-}
 
+// Parse an option value, printing the message of the failed conversion
+static bool readOption(const string &val, int * n) {
+  try { *n = str2int(val); } catch (...) { return false; }
+  return true;
+}
+static bool readOption(const string &val, double * d) {
+  try { *d = str2double(val); } catch (...) { return false; }
+  return true;
+}
+static bool readOption(const string &val, Date * d) {
+  try { *d = Date(val); } catch (...) { return false; }
+  return true;
+}
+static bool readOption(const string &val, Color * c) {
+  try { *c = Color(val); } catch (...) { return false; }
+  return true;
+}
 
 void Cladogram::parseOptions(const string filename) {
 
@@ -172,76 +192,95 @@ void Cladogram::parseOptions(const string filename) {
     }
 
     // assign options
-    try {
-
-      if     (opt == "infoBoxTitle") infoBoxTitle = val;
-      else if(opt == "infoBoxTitleSize") infoBoxTitleSize = str2int(val);
-      else if(opt == "infoBoxText") infoBoxText.push_back(val);
-      else if(opt == "infoBoxTextSize") infoBoxTextSize = str2int(val);
-      else if(opt == "infoBoxFont") infoBoxFont = val;
-      else if(opt == "infoBoxFontColor") infoBoxFontColor = Color(val);
-      else if(opt == "infoBoxColor1") infoBoxColor1 = Color(val);
-      else if(opt == "infoBoxColor2") infoBoxColor2 = Color(val);
-      else if(opt == "infoBoxX") infoBoxX = str2int(val);
-      else if(opt == "infoBoxY") infoBoxY = str2int(val);
-      else if(opt == "infoBoxWidth") infoBoxWidth = str2int(val);
-      else if(opt == "infoBoxHeight") infoBoxHeight = str2int(val);
-      else if(opt == "slice") slice = val;
-      else if(opt == "fontCorrectionFactor")fontCorrectionFactor=str2double(val);
-      else if(opt == "orientation") orientation = str2int(val);
-      else if(opt == "treeMode") treeMode = str2int(val);
-      else if(opt == "sortKey") sortKey = str2int(val);
-      else if(opt == "optimise") optimise = str2int(val);
-      else if(opt == "strictOverlaps") strictOverlaps = str2int(val);
-      else if(opt == "treeSpacing") treeSpacing = str2int(val);
-      else if(opt == "treeSpacingBiggerThan")treeSpacingBiggerThan=str2int(val);
-      else if(opt == "mainBackground") mainBackground = Color(val);
-      else if(opt == "rulerWidth") rulerWidth = str2int(val);
-      else if(opt == "rulerColor") rulerColor = Color(val);
-      else if(opt == "rulerMonthWidth") rulerMonthWidth = str2int(val);
-      else if(opt == "rulerMonthColor") rulerMonthColor = Color(val);
-      else if(opt == "lineWidth") lineWidth = str2int(val);
-      else if(opt == "offsetPX") offsetPX = str2int(val);
-      else if(opt == "stopFadeOutPX") stopFadeOutPX = str2int(val);
-      else if(opt == "stopSpacing") stopSpacing = Date(val);
-      else if(opt == "yearPX") yearPX = str2int(val);
-      else if(opt == "labelFont") labelFont = val;
-      else if(opt == "labelFontSize") labelFontSize = str2int(val);
-      else if(opt == "labelFontColor") labelFontColor = Color(val);
-      else if(opt == "labelBGOpacity") labelBGOpacity = str2int(val);
-      else if(opt == "asciiStrings") asciiStrings = str2int(val);
-      else if(opt == "nameChangeType") nameChangeType = str2int(val);
-      else if(opt == "derivType") derivType = str2int(val);
-      else if(opt == "dotRadius") dotRadius = str2int(val);
-      else if(opt == "smallDotRadius") smallDotRadius = str2int(val);
-      else if(opt == "dotType") dotType = str2int(val);
-      else if(opt == "bigParent") bigParent = str2double(val);
-      else if(opt == "connectorDots") connectorDots = str2int(val);
-      else if(opt == "connectorsDashed") connectorsDashed = str2int(val);
-      else if(opt == "yearLinePX") yearLinePX = str2int(val);
-      else if(opt == "yearLineColor1") yearLineColor1 = Color(val);
-      else if(opt == "yearLineColor2") yearLineColor2 = Color(val);
-      else if(opt == "yearLineFont") yearLineFont = val;
-      else if(opt == "yearLineFontSize") yearLineFontSize = str2int(val);
-      else if(opt == "yearLineFontColor") yearLineFontColor = Color(val);
-      else if(opt == "appendYears") appendYears = str2int(val);
-      else if(opt == "prependYears") prependYears = str2int(val);
-      else if(opt == "daysInMonth") daysInMonth = str2int(val);
-      else if(opt == "monthsInYear") monthsInYear = str2int(val);
-      else if(opt == "endOfTime") endOfTime = Date(val);
-      else if(opt == "descriptionType") descriptionType = str2int(val);
-      else if(opt == "dir_showDotFiles") dir_showDotFiles = str2int(val);
-      else if(opt == "dir_colorFile") dir_colorFile = Color(val);
-      else if(opt == "dir_colorDir") dir_colorDir = Color(val);
-      else if(opt == "dir_colorLink") dir_colorLink = Color(val);
-      else if(opt == "dir_domainSize") dir_domainSize = str2int(val);
-      else if(opt == "dir_domainIntensity") dir_domainIntensity = str2int(val);
-      else if(opt == "debug") debug = str2int(val);
-      else cout << "\nIGNORING unrecognised config option: " << opt;
-
-    } catch (...) {
-      throw "invalid config setting for option: " + opt;
+    bool valid = true;
+
+    if     (opt == "infoBoxTitle") infoBoxTitle = val;
+    else if(opt == "infoBoxTitleSize")
+      valid = readOption(val, &infoBoxTitleSize);
+    else if(opt == "infoBoxText") infoBoxText.push_back(val);
+    else if(opt == "infoBoxTextSize") valid = readOption(val, &infoBoxTextSize);
+    else if(opt == "infoBoxFont") infoBoxFont = val;
+    else if(opt == "infoBoxFontColor")
+      valid = readOption(val, &infoBoxFontColor);
+    else if(opt == "infoBoxColor1") valid = readOption(val, &infoBoxColor1);
+    else if(opt == "infoBoxColor2") valid = readOption(val, &infoBoxColor2);
+    else if(opt == "infoBoxX") valid = readOption(val, &infoBoxX);
+    else if(opt == "infoBoxY") valid = readOption(val, &infoBoxY);
+    else if(opt == "infoBoxWidth") valid = readOption(val, &infoBoxWidth);
+    else if(opt == "infoBoxHeight") valid = readOption(val, &infoBoxHeight);
+    else if(opt == "slice") slice = val;
+    else if(opt == "fontCorrectionFactor")
+      valid = readOption(val, &fontCorrectionFactor);
+    else if(opt == "orientation") valid = readOption(val, &orientation);
+    else if(opt == "treeMode") valid = readOption(val, &treeMode);
+    else if(opt == "sortKey") valid = readOption(val, &sortKey);
+    else if(opt == "optimise") valid = readOption(val, &optimise);
+    else if(opt == "strictOverlaps") {
+      int n = 0;
+      valid = readOption(val, &n);
+      strictOverlaps = (n != 0);
+    }
+    else if(opt == "packSingleRoots") {
+      int n = 0;
+      valid = readOption(val, &n);
+      packSingleRoots = (n != 0);
     }
+    else if(opt == "treeSpacing") valid = readOption(val, &treeSpacing);
+    else if(opt == "treeSpacingBiggerThan")
+      valid = readOption(val, &treeSpacingBiggerThan);
+    else if(opt == "layoutCache") layoutCache = val;
+    else if(opt == "optimiseBudgetMs")
+      valid = readOption(val, &optimiseBudgetMs);
+    else if(opt == "mainBackground") valid = readOption(val, &mainBackground);
+    else if(opt == "rulerWidth") valid = readOption(val, &rulerWidth);
+    else if(opt == "rulerColor") valid = readOption(val, &rulerColor);
+    else if(opt == "rulerMonthWidth") valid = readOption(val, &rulerMonthWidth);
+    else if(opt == "rulerMonthColor") valid = readOption(val, &rulerMonthColor);
+    else if(opt == "lineWidth") valid = readOption(val, &lineWidth);
+    else if(opt == "offsetPX") valid = readOption(val, &offsetPX);
+    else if(opt == "stopFadeOutPX") valid = readOption(val, &stopFadeOutPX);
+    else if(opt == "stopSpacing") valid = readOption(val, &stopSpacing);
+    else if(opt == "yearPX") valid = readOption(val, &yearPX);
+    else if(opt == "labelFont") labelFont = val;
+    else if(opt == "labelFontSize") valid = readOption(val, &labelFontSize);
+    else if(opt == "labelFontColor") valid = readOption(val, &labelFontColor);
+    else if(opt == "labelBGOpacity") valid = readOption(val, &labelBGOpacity);
+    else if(opt == "asciiStrings") valid = readOption(val, &asciiStrings);
+    else if(opt == "nameChangeType") valid = readOption(val, &nameChangeType);
+    else if(opt == "derivType") valid = readOption(val, &derivType);
+    else if(opt == "dotRadius") valid = readOption(val, &dotRadius);
+    else if(opt == "smallDotRadius") valid = readOption(val, &smallDotRadius);
+    else if(opt == "dotType") valid = readOption(val, &dotType);
+    else if(opt == "bigParent") valid = readOption(val, &bigParent);
+    else if(opt == "connectorDots") valid = readOption(val, &connectorDots);
+    else if(opt == "connectorsDashed")
+      valid = readOption(val, &connectorsDashed);
+    else if(opt == "yearLinePX") valid = readOption(val, &yearLinePX);
+    else if(opt == "yearLineColor1") valid = readOption(val, &yearLineColor1);
+    else if(opt == "yearLineColor2") valid = readOption(val, &yearLineColor2);
+    else if(opt == "yearLineFont") yearLineFont = val;
+    else if(opt == "yearLineFontSize")
+      valid = readOption(val, &yearLineFontSize);
+    else if(opt == "yearLineFontColor")
+      valid = readOption(val, &yearLineFontColor);
+    else if(opt == "appendYears") valid = readOption(val, &appendYears);
+    else if(opt == "prependYears") valid = readOption(val, &prependYears);
+    else if(opt == "daysInMonth") valid = readOption(val, &daysInMonth);
+    else if(opt == "monthsInYear") valid = readOption(val, &monthsInYear);
+    else if(opt == "endOfTime") valid = readOption(val, &endOfTime);
+    else if(opt == "descriptionType") valid = readOption(val, &descriptionType);
+    else if(opt == "dir_showDotFiles")
+      valid = readOption(val, &dir_showDotFiles);
+    else if(opt == "dir_colorFile") valid = readOption(val, &dir_colorFile);
+    else if(opt == "dir_colorDir") valid = readOption(val, &dir_colorDir);
+    else if(opt == "dir_colorLink") valid = readOption(val, &dir_colorLink);
+    else if(opt == "dir_domainSize") valid = readOption(val, &dir_domainSize);
+    else if(opt == "dir_domainIntensity")
+      valid = readOption(val, &dir_domainIntensity);
+    else if(opt == "debug") valid = readOption(val, &debug);
+    else cout << "\nIGNORING unrecognised config option: " << opt;
+
+    if(!valid) throw "invalid config setting for option: " + opt;
 
     if(debug > 0) cout << "\nDEBUG " << opt << " = " << val;
 
@@ -252,32 +291,70 @@ void Cladogram::parseOptions(const string filename) {
 }
 
 Node * Cladogram::addNode(std::string tname) {
-  Node * node = new Node;
+  Node * node = nodePool.allocate();
   node->name = tname;
   nodes.push_back(node);
   return node;
 }
 
 Domain * Cladogram::addDomain(std::string tname) {
-  Domain * domain = new Domain;
+  Domain * domain = domainPool.allocate();
   domain->nodeName = tname;
   domains.push_back(domain);
   return domain;
 }
 
 Connector * Cladogram::addConnector() {
-  Connector * c = new Connector;
+  Connector * c = connectorPool.allocate();
   connectors.push_back(c);
   return c;
 }
 
 Image * Cladogram::addImage(std::string tname, std::vector<Image *> &vector) {
-  Image * i = new Image;
+  Image * i = imagePool.allocate();
   i->filename = tname;
   vector.push_back(i);
   return i;
 }
 
+// Appends the nodes, domains, connectors and images of another cladogram.
+// The objects behind them change hands, other is left without any.
+void Cladogram::takeRecords(Cladogram &other) {
+  nodePool.take(other.nodePool);
+  domainPool.take(other.domainPool);
+  connectorPool.take(other.connectorPool);
+  imagePool.take(other.imagePool);
+  nodes.insert(nodes.end(), other.nodes.begin(), other.nodes.end());
+  domains.insert(domains.end(), other.domains.begin(), other.domains.end());
+  connectors.insert(connectors.end(), other.connectors.begin(),
+                    other.connectors.end());
+  includeSVG.insert(includeSVG.end(), other.includeSVG.begin(),
+                    other.includeSVG.end());
+  includePNG.insert(includePNG.end(), other.includePNG.begin(),
+                    other.includePNG.end());
+  other.nodes.clear();
+  other.domains.clear();
+  other.connectors.clear();
+  other.includeSVG.clear();
+  other.includePNG.clear();
+}
+
+// The passes of a tree layout in the order they run, which is also the order
+// of increasing cost: nextTree, pullToRoot, pullToParent
+static bool treePassEnabled(const int opt, const int pass) {
+  if(pass == 0) return opt >= 1;
+  if(pass == 1) return opt >= 6;
+  if(pass == 2) return opt >= 3 && opt < 8;
+  return false;
+}
+
+static int treePassCount(const int opt) {
+  int count = 0;
+  for(int pass = 0; pass < 3; ++pass)
+    if(treePassEnabled(opt, pass)) ++count;
+  return count;
+}
+
 void Cladogram::compute() {
 
   int nCount = (int)nodes.size();
@@ -288,9 +365,11 @@ void Cladogram::compute() {
                                        << cCount << " connectors and "
                                        << dCount << " domains...";
 
+  core.build(nodes, this);  // for the date keys
+
   if     (sortKey == 0) {}
   else if(sortKey == 1) stable_sort(nodes.begin(), nodes.end(), compareName());
-  else if(sortKey == 2) stable_sort(nodes.begin(), nodes.end(), compareDate());
+  else if(sortKey == 2) sortByKey(nodes.begin(), nodes.end(), keyDate(core));
 
   Node * n = NULL;
   Node * r = NULL;
@@ -306,8 +385,39 @@ void Cladogram::compute() {
   for(int i = 0; i < (int)includePNG.size(); ++i)
     includePNG[i]->filename = inputFolder + includePNG[i]->filename;
 
+  // Intern all names, from here on they are compared by id. Names that only
+  // refer to nodes aren't needed any more.
+  for(int i = 0; i < nCount; ++i) {
+    n = nodes[i];
+    n->nameId = symbols.intern(n->name);
+    n->parentId = symbols.intern(n->parentName);
+    string().swap(n->parentName);
+  }
+  for(int i = 0; i < dCount; ++i) {
+    d = domains[i];
+    d->nodeId = symbols.intern(d->nodeName);
+    string().swap(d->nodeName);
+  }
+  for(int i = 0; i < cCount; ++i) {
+    c = connectors[i];
+    c->fromId = symbols.intern(c->fromName);
+    c->toId = symbols.intern(c->toName);
+    string().swap(c->fromName);
+    string().swap(c->toName);
+  }
+
+  // Index nodes by name, so that parents, the slice, domains and connectors
+  // get resolved with a single lookup each. Nodes dropped from the vector below
+  // have to be removed from the index as well.
+  NodeIndex index;
+  index.build(nodes, symbols.size());
+  int erased = 0;
+
   // Basics
   // Juggle dates, warn for duplicates and assing parent pointers
+  // Surviving nodes are collected in order and replace the vector afterwards
+  vector<Node *> kept;
+  kept.reserve(nCount);
   for(int i = 0; i < nCount; ++i) {
 
     n = nodes[i];
@@ -317,18 +427,19 @@ void Cladogram::compute() {
       cout << "\nIgnoring " << n->name
            << " : starts after specified End Of Time";
 
-      nodes.erase(nodes.begin() + i);
-      --nCount;
-      --i;
+      index.remove(n);
+      ++erased;
       continue;
     }
+    kept.push_back(n);
 
     // Ignore nameChanges occuring after endOfTime
+    int ncCount = 0;
     for(int j = 0; j < (int)n->nameChanges.size(); ++j)
-      if(endOfTime < n->nameChanges[j].date) {
-        n->nameChanges.erase(n->nameChanges.begin() + j);
-        --j;
-      }
+      if( !(endOfTime < n->nameChanges[j].date) )
+        n->nameChanges[ncCount++] = n->nameChanges[j];
+    n->nameChanges.erase(n->nameChanges.begin() + ncCount,
+                         n->nameChanges.end());
 
     // If "stop" is newer than endOfTime, set "stop" to endOfTime
     if(endOfTime < n->stop)
@@ -353,23 +464,21 @@ void Cladogram::compute() {
       beginningOfTime = n->start;
 
     // Naming node same as parent is not allowed
-    string parName = n->parentName;
-    if(n->name == parName)
+    if(n->nameId == n->parentId)
       throw n->name + " has the same name as it's parent";
 
-    // Find pointer to parent and check for duplicates
-    for(int j = 0; j < nCount; ++j) {
-
-      if(j > i && n->name == nodes[j]->name)  // might result in bad children
-        cout << "\nWarning: " << n->name
-             << " (entry " << j+1 << ") is already listed at position " << i+1;
-
-      if(parName == nodes[j]->name)
-        n->parent = nodes[j];
+    // Check for duplicates and find pointer to parent
+    vector<int> dups;
+    index.laterDuplicates(n, dups);
+    for(int j = 0; j < (int)dups.size(); ++j)  // might result in bad children
+      cout << "\nWarning: " << n->name << " (entry " << dups[j] - erased + 1
+           << ") is already listed at position " << i - erased + 1;
 
-    }
-    if(parName != "" && n->parent == NULL)
-      throw "unable to find parent (" + parName +") for " + n->name;
+    if(n->parentId != SymbolTable::empty)
+      n->parent = index.find(n->parentId);
+    if(n->parentId != SymbolTable::empty && n->parent == NULL)
+      throw "unable to find parent (" + symbols.name(n->parentId) +") for "
+            + n->name;
 
     // Throw if node starts before parent and add node to parent's children
     if(n->parent != NULL) {
@@ -385,44 +494,55 @@ void Cladogram::compute() {
 
     }
   }
+  nodes.swap(kept);
+  nCount = (int)nodes.size();
+  core.build(nodes, this);  // the dates have been completed
+
+  // Cache root pointers, depths and subtree intervals
+  compute_tree();
 
   // If node is not within slice, erase it
+  // The slice node becomes the root of all remaining nodes in its subtree
   if(slice != "") {
-    Node * sliceNode = 0;
-    for(int i = 0; i < nCount; ++i)
-      if(nodes[i]->name == slice) sliceNode = nodes[i];
+    Node * sliceNode = index.find(symbols.find(slice));
     if(sliceNode == NULL) throw "unable to slice node " + slice;
 
     sliceNode->parent = NULL;
-    sliceNode->parentName = "";
+    sliceNode->parentId = SymbolTable::empty;
     beginningOfTime = sliceNode->start;
 
+    int count = 0;
     for(int i = 0; i < nCount; ++i) {
       n = nodes[i];
-      if( n->name != slice && !n->derivesFrom(sliceNode) ) {
-        nodes.erase(nodes.begin() + i);
-        --nCount;
-        --i;
-      }
+      if( n->nameId != sliceNode->nameId && !n->derivesFrom(sliceNode) )
+        index.remove(n);
+      else
+        nodes[count++] = n;
     }
+    nodes.erase(nodes.begin() + count, nodes.end());
+    nCount = count;
+
+    compute_tree();
   }
 
   // Assign nodes to domains
+  int count = 0;
   for(int i = 0; i < dCount; ++i) {
     d = domains[i];
-    for(int j = 0; j < nCount; ++j)
-      if(nodes[j]->name == d->nodeName)
-        d->node = nodes[j];
+    d->node = index.find(d->nodeId);
 
     if(d->node == NULL || endOfTime < d->node->start) {
-      cout << "\nWarning: unable to assign domain to " + d->nodeName;
-      domains.erase(domains.begin() + i);
-      --dCount;
-      --i;
+      cout << "\nWarning: unable to assign domain to "
+           << symbols.name(d->nodeId);
+      continue;
     }
+    domains[count++] = d;
   }
+  domains.erase(domains.begin() + count, domains.end());
+  dCount = count;
 
   // Assign nodes to connectors
+  count = 0;
   for(int i = 0; i < cCount; ++i) {
 
     c = connectors[i];
@@ -434,33 +554,27 @@ void Cladogram::compute() {
     if(c->toWhen.day == 0) c->toWhen.day = 1;
 
     if(endOfTime < c->fromWhen || endOfTime < c->toWhen) {
-      cout << "\nIGNORING connector " << c->fromName << " -> " << c->toName
+      cout << "\nIGNORING connector " << symbols.name(c->fromId) << " -> "
+           << symbols.name(c->toId)
            << " (starting " << c->fromWhen.year<< "." << c->fromWhen.month
            << "." << c->fromWhen.day << " stopping " << c->toWhen.year << "."
            << c->toWhen.month << "." << c->toWhen.day
            << "): reaches after specified End Of Time";
-      connectors.erase(connectors.begin() + i);
-      --cCount;
-      --i;
       continue;
     }
 
-    for(int j = 0; j < nCount; ++j) {
-      if(nodes[j]->name == c->fromName)
-        c->from = nodes[j];
-      if(nodes[j]->name == c->toName)
-        c->to = nodes[j];
-    }
+    c->from = index.find(c->fromId);
+    c->to = index.find(c->toId);
 
     if(c->from == NULL || c->to == NULL) {
       cout << "\nWarning: unable to assign connector "
-           << c->fromName << " -> " << c->toName;
-      connectors.erase(connectors.begin() + i);
-      --cCount;
-      --i;
+           << symbols.name(c->fromId) << " -> " << symbols.name(c->toId);
       continue;
     }
+    connectors[count++] = c;
   }
+  connectors.erase(connectors.begin() + count, connectors.end());
+  cCount = count;
 
   // Truncate folder names, used in dir parser
   if(truncateFolder == true)
@@ -471,11 +585,24 @@ void Cladogram::compute() {
 
   // Push through size
   // Requires full parent paths, hence a new pass
-  for(int i = 0; i < nCount; ++i) {
-    n = nodes[i];
-    while(n->parent != NULL) {
-      n->parent->size += 1;
-      n = n->parent;
+  compute_subtreeAggregates();
+
+  for(int i = 0; i < dCount; ++i)
+    if(domains[i]->node->size < treeSpacingBiggerThan)
+      cout << "\nWARNING: domain of node " << domains[i]->node->name
+           << " will not get spaced and may overlap with other lines (it's"
+           << " tree is too small). Reduce the treeSpacingBiggerThan config"
+           << " option.";
+
+  // Reuse the layout of an earlier run with the same data and layout options
+  vector<Node *> unplaced;  // the nodes in their order before the layout
+  string cacheKey = "";
+  if(layoutCache != "") {
+    unplaced = nodes;
+    cacheKey = layoutCache_key(unplaced);
+    if(layoutCache_load(cacheKey, unplaced)) {
+      if(debug > 0) debug_cladogram_compute();
+      return;
     }
   }
 
@@ -484,36 +611,40 @@ void Cladogram::compute() {
   // Requires correct size on all nodes, hence a new pass
   roots.clear();
   for(int i = 0; i < nCount; ++i)
-    if(nodes[i]->parentName == "") roots.push_back( nodes[i]);
+    if(nodes[i]->parentId == SymbolTable::empty) roots.push_back( nodes[i]);
   int rCount = (int)roots.size();
   int offset = 0;
   for(int i = 0; i < rCount; ++i) {
 
-    int treeOffset = 0;
     r = roots[i];
-    std::deque<Node *> nodeTree;
-    nodeTree.push_back(r);
+    vector<Node *> nodeTree;
+
+    // Expand the tree in a single pass. The stack holds the subtrees still to
+    // expand (true) and the nodes to append to the tree once all subtrees
+    // above them are done (false).
+    vector< pair<Node *, bool> > todo;
+    todo.push_back( make_pair(r, true) );
+    while(todo.size() > 0) {
 
-    // Expand the tree if the current root size is bigger than 1
-    while((int)nodeTree.size() < r->size) {
+      n = todo.back().first;
+      bool expand = todo.back().second;
+      todo.pop_back();
 
-      n = nodeTree[treeOffset];
-      if(n->offset == -1) {
-        ++treeOffset;
+      if(expand == false || n->children.size() == 0) {
+        nodeTree.push_back(n);
         continue;
       }
 
-      // Mark current node as "processed" by setting it's offset to -1
-      n->offset = -1;
-
-      stable_sort(n->children.begin(), n->children.end(), compareDate());
+      sortByKey(n->children.begin(), n->children.end(), keyDate(core));
 
       if(treeMode == 0)
-        compute_subtreeBoth(nodeTree, treeOffset, n);
+        compute_subtreeBoth(todo, n);
       else if(treeMode == 1)
-        compute_subtreeLower(nodeTree, treeOffset, n);
+        compute_subtreeLower(todo, n);
       else if(treeMode == 2)
-        compute_subtreeLowerInverse(nodeTree, treeOffset, n);
+        compute_subtreeLowerInverse(todo, n);
+      else
+        nodeTree.push_back(n);
 
     }
 
@@ -529,22 +660,44 @@ void Cladogram::compute() {
 
   }
 
+  // The time frame and the trees are known by now
+  core.build(nodes, this);
+
   // Optimisation: queue single nodes and squash trees
   // Optmisation will fail (moveTo() and tree optimisations) if the vectors are
   // not sorted by offset.
-  stable_sort(nodes.begin(), nodes.end(), compareOffset());
-  stable_sort(roots.begin(), roots.end(), compareOffset());
+  sortByKey(nodes.begin(), nodes.end(), keyOffset());
+  sortByKey(roots.begin(), roots.end(), keyOffset());
+  set<Node *> laidOut;  // trees already optimised on their own
+  passesDone = 0;
+  passesTotal = 0;
+  double optimiseStart = wallClockMs();
+  if(optimiseBudgetMs > 0) optimiseDeadline = optimiseStart + optimiseBudgetMs;
+  if(optimise != 0) optimise_trees(laidOut);
+  if(optimise != 0 && packSingleRoots) {
+    ++passesTotal;
+    if(optimiseBudgetMs == 0 || wallClockMs() <= optimiseDeadline) {
+      optimise_packSingleRoots();
+      ++passesDone;
+    }
+  }
+  lanes.build(nodes, core);  // from here on, offsets change through the lanes
+  Layout map(this, lanes, nodes, false);
   for(int i = 0; i < rCount; ++i) {
 
     // KEEP USAGE OF THE OPTIMISE VARIABLE WITHIN THIS LOOP
 
     if(optimise == 0) break;
     r = roots[i];
+    if(r->size == 1 && optimise/10 >= 1 && !packSingleRoots) ++passesTotal;
+    if(optimiseBudgetMs > 0 && wallClockMs() > optimiseDeadline) continue;
 
     if(r->size == 1) {  // Single root
 
+      if(packSingleRoots) continue;  // already packed
       int opt = optimise/10;
       if(opt > 9) opt = 9;
+      if(opt >= 1) ++passesDone;
 
       // Don't reach behind trees of certain size, depending on opt
       int treeBarrierSize[] = { 0, 1, 2, 3 ,5, 10, 20, 50, 99999999, 99999999};
@@ -553,19 +706,19 @@ void Cladogram::compute() {
         if(roots[upTo]->size > treeBarrierSize[opt]) break;
       if(upTo > rCount) upTo = rCount;
 
-      if(opt >= 1) optimise_injectSingleRootAt(i, upTo);
+      if(opt >= 1) optimise_injectSingleRootAt(map, i, upTo);
 
-    } else {  // Tree root
+    } else if(laidOut.count(r) == 0) {  // Tree root
 
       int opt = optimise%10;
 
       // Get first and last node positions of current continuous root tree block
       int first = 0;
-      while(first < nCount && nodes[first]->root() != r) ++first;
+      while(first < nCount && nodes[first]->rootNode != r) ++first;
       int last = first;
-      while(last < nCount && nodes[last]->root() == r) ++last;
+      while(last < nCount && nodes[last]->rootNode == r) ++last;
 
-      if(opt >= 1) optimise_nextTree(first, last);
+      if(opt >= 1) map.optimise_nextTree(first, last);
 
       // optimise: if node i (has no children and) ends before i+1 starts, put them on same side
 
@@ -576,12 +729,14 @@ void Cladogram::compute() {
       //~ }
 
       if(opt >= 6)
-        optimise_pullToRoot(first, last, (opt>=8)?(true):(false) );
+        map.optimise_pullToRoot(first, last, (opt>=8)?(true):(false) );
       if(opt >= 3 && opt < 8)
-        optimise_pullToParent(r, first, last);
+        map.optimise_pullToParent(r, first, last);
+      passesDone += treePassCount(opt);
 
     }
   }
+  double optimiseMs = wallClockMs() - optimiseStart;
 // ToDo: mix single nodes and trees
   //~ // Inject single roots into everything processed so far, after the main
   //~ // optimisation as to preserve the tight trees
@@ -615,13 +770,13 @@ void Cladogram::compute() {
   for(int i = 0; i < nCount - 1; ++i) {
     a = nodes[i];
     b = nodes[i+1];
-    ar = a->root();
-    br = b->root();
+    ar = a->rootNode;
+    br = b->rootNode;
     // if not in same tree and at least one has children
     if( ar != br && (ar->children.size() > 0 || br->children.size() > 0) )
       if(ar->size > treeSpacingBiggerThan ||  // honor option
          br->size > treeSpacingBiggerThan)
-        moveOffsetsHigherThan(a->offset, treeSpacing);
+        map.moveOffsetsHigherThan(lanes.offset(a), treeSpacing);
   }
 
   // Insert spacing at fat lines (bigParent) 
@@ -629,27 +784,63 @@ void Cladogram::compute() {
   if(bigParent > 0) {
     for(int i = 0; i < nCount - 1; ++i) {
       n = nodes[i];
-      if( (lineWidth * (sqrt(n->size)-1) * bigParent) / offsetPX  >  0.6 ) {
-        moveOffsetsHigherThan(n->offset-1, 1);
-        moveOffsetsHigherThan(n->offset, 1);
+      if( (lineWidth * n->lineGrowth) / offsetPX  >  0.6 ) {
+        map.moveOffsetsHigherThan(lanes.offset(n)-1, 1);
+        map.moveOffsetsHigherThan(lanes.offset(n), 1);
       }
 
     }
   }
 
+  // Offsets are only resolved through the lanes up to here
+  lanes.materialize();
+  lanes.clear();
+
   // Set domain offsets
+  // The offsets of all nodes are kept in preorder, so that the descendants of
+  // a node form an interval, in a segment tree of minima and maxima
+  int treeSize = 1;
+  while(treeSize < (int)tour.size()) treeSize *= 2;
+  vector<int> minTree, maxTree;
+  vector<Node *> strays;  // nodes without an interval
+  if(dCount > 0) {
+    minTree.assign(2 * treeSize, numeric_limits<int>::max());
+    maxTree.assign(2 * treeSize, numeric_limits<int>::min());
+    for(int i = 0; i < nCount; ++i) {
+      n = nodes[i];
+      if(n->eulerIn < 0) {
+        strays.push_back(n);
+        continue;
+      }
+      minTree[treeSize + n->eulerIn] = n->offset;
+      maxTree[treeSize + n->eulerIn] = n->offset;
+    }
+    for(int i = treeSize - 1; i > 0; --i) {
+      minTree[i] = std::min(minTree[2*i], minTree[2*i+1]);
+      maxTree[i] = std::max(maxTree[2*i], maxTree[2*i+1]);
+    }
+  }
   for(int i = 0; i < dCount; ++i) {
     d = domains[i];
 
-    if(d->node->size < treeSpacingBiggerThan)
-      cout << "\nWARNING: domain of node " << d->node->name << " will not get"
-           << " spaced and may overlap with other lines (it's tree is"
-           << " too small). Reduce the treeSpacingBiggerThan config option.";
-
     // Get minimum and maximum offsets of children this domain's node has
     int min = nodes[nCount-1]->offset, max = 0;
-    for(int j = 0; j < nCount; ++j) {
-      n = nodes[j];
+    if(d->node->eulerIn >= 0) {
+      int a = treeSize + d->node->eulerIn + 1;
+      int b = treeSize + d->node->eulerOut + 1;
+      for(; a < b; a /= 2, b /= 2) {
+        if(a % 2 == 1) {
+          min = std::min(min, minTree[a]);
+          max = std::max(max, maxTree[a++]);
+        }
+        if(b % 2 == 1) {
+          min = std::min(min, minTree[--b]);
+          max = std::max(max, maxTree[b]);
+        }
+      }
+    }
+    for(int j = 0; j < (int)strays.size(); ++j) {
+      n = strays[j];
       if(n->derivesFrom(d->node)) {
         if(n->offset < min)
           min = n->offset;
@@ -680,12 +871,84 @@ void Cladogram::compute() {
     if(maximumOffset < nodes[i]->offset)
       maximumOffset = nodes[i]->offset;
 
+  // A layout cut short by the budget isn't worth keeping
+  if(layoutCache != "" && passesDone == passesTotal)
+    layoutCache_store(cacheKey, unplaced);
+
+  // Passes which started in time still finish and the lanes get built in any
+  // case, so the budget can be overrun
+  if(optimise != 0 && optimiseBudgetMs > 0) {
+    cout << "\nOptimisation: " << passesDone << " of " << passesTotal
+         << " passes done in " << (int)optimiseMs << " ms";
+    if(optimiseMs > optimiseBudgetMs)
+      cout << ", over the budget of " << optimiseBudgetMs << " ms";
+    cout << ", maximumOffset = " << maximumOffset;
+  }
 
   if(debug > 0) debug_cladogram_compute();
 
 }
 
 
+// Caches the root pointer, the depth and the preorder interval of the subtree
+// (eulerIn to eulerOut) on every node. Nodes which can't be reached from a root
+// (their parent got sliced away) only get the root and depth, by walking up.
+void Cladogram::compute_tree() {
+
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    nodes[i]->rootNode = NULL;
+    nodes[i]->eulerIn = -1;
+    nodes[i]->eulerOut = -1;
+  }
+
+  tour.clear();
+  vector< pair<Node *, int> > stack;  // node and its next child
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    Node * r = nodes[i];
+    if(r->parent != NULL) continue;
+
+    r->rootNode = r;
+    r->depth = 0;
+    r->eulerIn = tour.size();
+    tour.push_back(r);
+    stack.push_back( make_pair(r, 0) );
+    while(stack.size() > 0) {
+      Node * n = stack.back().first;
+      int c = stack.back().second++;
+      if(c < (int)n->children.size()) {
+        Node * child = n->children[c];
+        child->rootNode = r;
+        child->depth = n->depth + 1;
+        child->eulerIn = tour.size();
+        tour.push_back(child);
+        stack.push_back( make_pair(child, 0) );
+      } else {
+        n->eulerOut = tour.size() - 1;
+        stack.pop_back();
+      }
+    }
+  }
+
+  vector<Node *> path;
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    Node * n = nodes[i];
+    while(n->rootNode == NULL && n->parent != NULL) {
+      path.push_back(n);
+      n = n->parent;
+    }
+    if(n->rootNode == NULL) {
+      n->rootNode = n;
+      n->depth = 0;
+    }
+    while(path.size() > 0) {
+      n = path.back();
+      n->rootNode = n->parent->rootNode;
+      n->depth = n->parent->depth + 1;
+      path.pop_back();
+    }
+  }
+}
+
 // Prints some debug info
 void Cladogram::debug_cladogram_compute() {
 
@@ -698,13 +961,14 @@ void Cladogram::debug_cladogram_compute() {
   cout << "\n";
   for(int i = 0; i < (int)connectors.size(); ++i) {
     Connector * c = connectors[i];
-    cout << "\nDEBUG\t" << c->fromName << "  \t=>\t" << c->toName
+    cout << "\nDEBUG\t" << symbols.name(c->fromId) << "  \t=>\t"
+         << symbols.name(c->toId)
          << "   \t(" << c->offsetA << ","<< c->offsetB << ")";
   }
   cout << "\n";
   for(int i = 0; i < (int)domains.size(); ++i) {
     Domain * d = domains[i];
-    cout << "\nDEBUG\t domain " << d->nodeName
+    cout << "\nDEBUG\t domain " << symbols.name(d->nodeId)
          << "    \t(" << d->offsetA << "," << d->offsetB << ")";
   }
   cout << "\n\nDEBUG\tFrom "
@@ -716,73 +980,114 @@ void Cladogram::debug_cladogram_compute() {
 
 }
 
+// The subtree functions push the children of a node together with the node
+// itself onto the stack, in reverse order of their appearance in the tree.
+
 // Generates a treeMap with the children distributed on both sides
-void Cladogram::compute_subtreeBoth(std::deque<Node *> &tree,
-                                    int pos, Node * n) {
+// The upper subtree goes before the current node, the lower subtree after it
+// in reverse order
+void Cladogram::compute_subtreeBoth(vector< pair<Node *, bool> > &todo,
+                                    Node * n) {
 
   int childCount = (int)n->children.size();
 
-  // Insert the upper subtree before current node
-  for(int i = 1; i < childCount; i += 2)
-    tree.insert(tree.begin() + pos + i/2, n->children[i]);
-
-  // Insert the lower subtree after current node in reverse order
   for(int i = 0; i < childCount; i += 2)
-    tree.insert(tree.begin() + pos + (childCount/2) + 1, n->children[i]);
+    todo.push_back( make_pair(n->children[i], true) );
+
+  todo.push_back( make_pair(n, false) );
+
+  for(int i = childCount - 1 - childCount%2; i >= 1; i -= 2)
+    todo.push_back( make_pair(n->children[i], true) );
 
 }
 
 // Generates a treeMap with the children only below the parent
-// Insert all child nodes after current node in reverse order
-void Cladogram::compute_subtreeLower(std::deque<Node *> &tree,
-                                    int pos, Node * n) {
+// All child nodes go after current node in reverse order
+void Cladogram::compute_subtreeLower(vector< pair<Node *, bool> > &todo,
+                                     Node * n) {
   for(int i = 0; i < (int)n->children.size(); ++i)
-    tree.insert(tree.begin() + pos + 1, n->children[i]);
+    todo.push_back( make_pair(n->children[i], true) );
+  todo.push_back( make_pair(n, false) );
 }
 
 // Generates a treeMap with the children only below the parent - inverse order
-// Insert all child nodes after current node
-void Cladogram::compute_subtreeLowerInverse(std::deque<Node *> &tree,
-                                    int pos, Node * n) {
-  for(int i = 0; i < (int)n->children.size(); ++i)
-    tree.insert(tree.begin() + pos + 1 + i, n->children[i]);
+// All child nodes go after current node
+void Cladogram::compute_subtreeLowerInverse(vector< pair<Node *, bool> > &todo,
+                                            Node * n) {
+  for(int i = (int)n->children.size() - 1; i >= 0; --i)
+    todo.push_back( make_pair(n->children[i], true) );
+  todo.push_back( make_pair(n, false) );
+}
+
+Layout::Layout(Cladogram * tclad, LaneIndex &tlanes, vector<Node *> &tnodes,
+               bool tlocal)
+  : clad(tclad), lanes(tlanes), nodes(tnodes), local(tlocal) {
+  escaped = false;
+  end = 0;
+  int MinY = clad->monthsInYear;
+  int DinM = clad->daysInMonth;
+  timeStartKey = clad->core.key(clad->beginningOfTime);
+  timeStopKey = clad->core.key(rOf(clad->endOfTime + clad->stopSpacing,
+                                   MinY, DinM));
+}
+
+// Moves a node to the given offset. In a local layout, the offset has to lie
+// within the tree.
+void Layout::move(Node * node, const int offset) {
+  if(local && (offset < 0 || offset >= end)) escaped = true;
+  lanes.move(node, offset);
 }
 
 // Returns true if specified node fits into given offset
 // without overlapping other nodes in that offset.
 // False otherwise.
-bool Cladogram::fitsInto(const int offset, Node * node) {
-
-  vector<Node *> tmp;
-  for(int i = 0; i < (int)nodes.size(); ++i)
-    if(nodes[i]->offset == offset)
-      tmp.push_back(nodes[i]);
+bool Layout::fitsInto(const int offset, Node * node) {
 
-  if(offset == node->offset) return false;
-  if(tmp.size() == 0) return true;
+  if(offset == lanes.offset(node)) return false;
+  const LayoutCore &core = clad->core;
+  return fitsInto(offset, core.startKey[node->index],
+                  core.stopSpacedKey[node->index]);
+}
 
-  sort(tmp.begin(), tmp.end(), compareDate());
+// Returns true if a node starting and stopping (plus spacing) at the given
+// date keys fits into given offset.
+bool Layout::fitsInto(const int offset, const int startKey,
+                      const int stopSpacedKey) {
 
-  int DinM = daysInMonth;
-  int MinY = monthsInYear;
+  const LaneIndex::Lane * lane = lanes.lane(offset);
+  if(lane == NULL) return true;
 
-  // Compare node to first and last in tmp, then to all others
-  if( rOf(node->stop + stopSpacing, MinY, DinM) < tmp[0]->start ||
-      rOf(tmp[tmp.size()-1]->stop + stopSpacing, MinY, DinM) < node->start )
+  // The lane is sorted by start, so the only gap the node can fit into is the
+  // one in front of the first lane node starting after the node (plus spacing)
+  // has stopped. The gap right before the last lane node is never used.
+  LaneIndex::Lane::const_iterator next =
+    lanes.startingAfter(lane, stopSpacedKey);
+  if(next == lane->begin())
     return true;
-  for(int i = 0; i < (int)tmp.size() - 2; ++i)
-    if( rOf(tmp[i]->stop + stopSpacing, MinY, DinM) < node->start &&
-        rOf(node->stop + stopSpacing, MinY, DinM) < tmp[i+1]->start )
+  if(lane->rbegin()->stopSpacedKey < startKey)
+    return true;
+
+  LaneIndex::Lane::const_iterator prev = next, after = next;
+  --prev;
+  if(next != lane->end() && ++after != lane->end())
+    if(prev->stopSpacedKey < startKey)
       return true;
 
   return false;
 }
 
 // Move all nodes with an offset higher than the specified one by given value.
-void Cladogram::moveOffsetsHigherThan(const int offset, const int move) {
-  for(int i = 0; i < (int)nodes.size(); ++i)
-    if(nodes[i]->offset > offset)
-      nodes[i]->offset += move;
+// In a local layout, the trees above move along. That leaves them untouched
+// as long as the shift starts below the top lane of the tree, or at the top
+// lane if it is empty.
+void Layout::moveOffsetsHigherThan(const int offset, const int move) {
+  if(local) {
+    if(offset < 0 || offset >= end ||
+       (offset == end - 1 && lanes.lane(offset) != NULL))
+      escaped = true;
+    end += move;
+  }
+  lanes.shift(offset, move);
 }
 
 // Moves a specified node to the front of the given vector
@@ -791,7 +1096,7 @@ void Cladogram::moveOffsetsHigherThan(const int offset, const int move) {
 void Cladogram::moveTo(int offset, Node * node, vector<Node *> &v) {
   int i = (int)v.size() - 1;
   while(i > 0 && v[i] != node) --i;
-  while(i > 0 && v[i-1]->offset > offset) {
+  while(i > 0 && lanes.offset(v[i-1]) > offset) {
     swap(v[i-1], v[i]);
     --i;
   }
@@ -799,7 +1104,7 @@ void Cladogram::moveTo(int offset, Node * node, vector<Node *> &v) {
 
 // Inject single roots into specified position i if possible,
 // until we hit upTo.
-void Cladogram::optimise_injectSingleRootAt(int pos, int upTo) {
+void Cladogram::optimise_injectSingleRootAt(Layout &map, int pos, int upTo) {
   Node * r = roots[pos];
   Node * cand;
 
@@ -807,11 +1112,12 @@ void Cladogram::optimise_injectSingleRootAt(int pos, int upTo) {
 
     cand = roots[i];
 
-    if(cand->size == 1 && fitsInto(r->offset, cand)) {
-      moveOffsetsHigherThan(cand->offset, -1);
-      cand->offset = r->offset;
-      moveTo(r->offset, cand, nodes);  // update order of nodes in vector
-      moveTo(r->offset, cand, roots);
+    if(cand->size == 1 && map.fitsInto(lanes.offset(r), cand)) {
+      map.moveOffsetsHigherThan(lanes.offset(cand), -1);
+      int offset = lanes.offset(r);
+      lanes.move(cand, offset);
+      moveTo(offset, cand, nodes);  // update order of nodes in vector
+      moveTo(offset, cand, roots);
       break;  // break because we try once again for every injected node anyway
     }
 
@@ -819,65 +1125,399 @@ void Cladogram::optimise_injectSingleRootAt(int pos, int upTo) {
 
 }
 
+// Returns true if single root a starts before single root b
+struct compareSingleStart : public std::binary_function<int,int,bool> {
+  vector<Node *> * singles;
+  const LayoutCore * core;
+  inline bool operator()(const int a, const int b) {
+    return core->startKey[(*singles)[a]->index] <
+           core->startKey[(*singles)[b]->index];
+  }
+};
+
+// Pack all single roots into as few lanes as possible: sweep them by start and
+// reuse the lane which ended first, if it ended (plus stopSpacing) before.
+// Each lane stays on the offset of its first single root, the offsets the
+// others leave behind are closed. Works on the node offsets, not the lanes.
+void Cladogram::optimise_packSingleRoots() {
+  vector<Node *> singles;
+  for(int i = 0; i < (int)roots.size(); ++i)
+    if(roots[i]->size == 1) singles.push_back(roots[i]);
+  int count = (int)singles.size();
+  if(count < 2) return;
+
+  vector<int> order;
+  for(int i = 0; i < count; ++i)
+    order.push_back(i);
+  compareSingleStart byStart;
+  byStart.singles = &singles;
+  byStart.core = &core;
+  stable_sort(order.begin(), order.end(), byStart);
+
+  vector<int> group(count);
+  int groups = 0;
+  // Lane ends (stop plus spacing) and lane numbers, smallest end on top
+  priority_queue< pair<int,int>, vector< pair<int,int> >,
+                  greater< pair<int,int> > > ends;
+  for(int i = 0; i < count; ++i) {
+    Node * n = singles[order[i]];
+    int g;
+    if(ends.empty() == false && ends.top().first < core.startKey[n->index]) {
+      g = ends.top().second;
+      ends.pop();
+    } else g = groups++;
+    group[order[i]] = g;
+    ends.push(make_pair(core.stopSpacedKey[n->index], g));
+  }
+  if(groups == count) return;
+
+  // The singles are in offset order, so the first of a group keeps its lane
+  vector<int> home(groups, -1);
+  vector<int> closed;
+  for(int i = 0; i < count; ++i) {
+    int g = group[i];
+    if(home[g] < 0) home[g] = singles[i]->offset;
+    else closed.push_back(singles[i]->offset);
+  }
+  sort(closed.begin(), closed.end());
+
+  for(int i = 0; i < count; ++i)
+    singles[i]->offset = home[group[i]];
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    nodes[i]->offset -= int(lower_bound(closed.begin(), closed.end(),
+                                        nodes[i]->offset) - closed.begin());
+
+  sortByKey(nodes.begin(), nodes.end(), keyOffset());
+  sortByKey(roots.begin(), roots.end(), keyOffset());
+}
+
+// A root tree laid out on its own, on the offsets 0 to span - 1
+struct TreeJob {
+  Cladogram * clad;
+  Node * root;
+  vector<Node *> nodes;
+  vector<Node *> before;              // nodes as they were before
+  vector< vector<Node *> > children;  // children as they were before
+  LaneIndex lanes;
+  bool indexed;  // the lanes were built before the deadline
+  int span;
+  bool escaped;
+  string key;
+  bool cached;  // the layout was taken from the snapshot
+  TreeSnapshot snapshot;
+  double deadline;  // wall clock ms after which no pass starts, 0 = none
+  int passes;       // passes run
+};
+
+TreeSnapshot::TreeSnapshot() {
+  span = 0;
+  escaped = false;
+}
+
+// Steps through the layout of a tree: -1 puts the nodes into their own lanes,
+// 0 to 2 are the passes and 3 collects the result
+static void layoutTree(TreeJob &job, const int step) {
+  if(job.cached) return;
+
+  Cladogram * clad = job.clad;
+  int opt = clad->optimise%10;
+  int size = (int)job.nodes.size();
+
+  if(step == -1) {
+    job.before = job.nodes;
+    for(int i = 0; i < size; ++i)
+      job.nodes[i]->offset = i;
+    job.indexed = (job.deadline == 0 || wallClockMs() <= job.deadline);
+    if(job.indexed) job.lanes.build(job.nodes, clad->core);
+    job.span = size;
+    job.escaped = false;
+    job.passes = 0;
+    return;
+  }
+
+  if(step < 3) {
+    if(treePassEnabled(opt, step) == false) return;
+    if(job.deadline > 0 && wallClockMs() > job.deadline) return;
+    if(job.indexed == false) return;
+    Layout layout(clad, job.lanes, job.nodes, true);
+    layout.end = job.span;
+    if(step == 0) layout.optimise_nextTree(0, size);
+    if(step == 1)
+      layout.optimise_pullToRoot(0, size, (opt>=8)?(true):(false) );
+    if(step == 2) layout.optimise_pullToParent(job.root, 0, size);
+    if(layout.escaped) job.escaped = true;
+    job.span = layout.end;
+    ++job.passes;
+    return;
+  }
+
+  job.lanes.materialize();
+  job.lanes.clear();
+
+  // The tree has to end up below the offset the next tree starts at
+  for(int i = 0; i < size; ++i) {
+    int offset = job.nodes[i]->offset;
+    if(offset < 0 || offset >= job.span) job.escaped = true;
+  }
+
+  // Keep the result, with the nodes referred to by their former position.
+  // Only complete layouts go into the cache.
+  if(clad->layoutCache == "" || job.passes != treePassCount(opt)) return;
+  map<Node *, int> pos;
+  for(int i = 0; i < size; ++i)
+    pos[job.before[i]] = i;
+  TreeSnapshot &snap = job.snapshot;
+  snap.span = job.span;
+  snap.escaped = job.escaped;
+  snap.children.resize(size);
+  for(int i = 0; i < size; ++i) {
+    snap.order.push_back(pos[job.nodes[i]]);
+    snap.offsets.push_back(job.nodes[i]->offset);
+    Node * n = job.before[i];
+    for(int j = 0; j < (int)n->children.size(); ++j)
+      snap.children[i].push_back(pos[n->children[j]]);
+  }
+}
+
+// Takes the layout of a tree from its snapshot. Returns false and leaves the
+// tree untouched if the snapshot doesn't fit.
+static bool restoreTree(TreeJob &job, const TreeSnapshot &snap) {
+  int size = (int)job.nodes.size();
+  if((int)snap.order.size() != size || (int)snap.offsets.size() != size ||
+     (int)snap.children.size() != size)
+    return false;
+  for(int i = 0; i < size; ++i) {
+    if(snap.order[i] < 0 || snap.order[i] >= size ||
+       snap.children[i].size() != job.nodes[i]->children.size())
+      return false;
+    for(int j = 0; j < (int)snap.children[i].size(); ++j)
+      if(snap.children[i][j] < 0 || snap.children[i][j] >= size)
+        return false;
+  }
+
+  vector<Node *> before = job.nodes;
+  for(int i = 0; i < size; ++i) {
+    job.nodes[i] = before[snap.order[i]];
+    job.nodes[i]->offset = snap.offsets[i];
+    for(int j = 0; j < (int)snap.children[i].size(); ++j)
+      before[i]->children[j] = before[snap.children[i][j]];
+  }
+  job.span = snap.span;
+  job.escaped = snap.escaped;
+  job.snapshot = snap;
+  job.cached = true;
+  return true;
+}
+
+#ifdef GNUCLAD_POSIX
+struct TreeJobQueue {
+  vector<TreeJob> * trees;
+  vector<int> * order;
+  int step;
+  int next;
+  pthread_mutex_t lock;
+};
+
+static void * layoutTreeWorker(void * arg) {
+  TreeJobQueue * queue = (TreeJobQueue *)arg;
+  while(true) {
+    pthread_mutex_lock(&queue->lock);
+    int i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if(i >= (int)queue->order->size()) break;
+    layoutTree((*queue->trees)[(*queue->order)[i]], queue->step);
+  }
+  return NULL;
+}
+#endif
+
+// Returns true if tree a is smaller than tree b
+struct compareJobSize : public std::binary_function<int,int,bool> {
+  vector<TreeJob> * trees;
+  inline bool operator()(const int a, const int b) {
+    return (*trees)[a].nodes.size() < (*trees)[b].nodes.size();
+  }
+};
+
+// Optimise all root trees on their own, in local offsets and on up to jobs
+// threads. As long as no node gets pulled out of its tree, this is the same as
+// optimising the trees within the map. From the first tree where that happens
+// on, the trees are put back as they were and left to compute().
+// Every pass runs over all trees, smallest first, before the next one starts,
+// so that running out of optimiseBudgetMs leaves the cheap passes done.
+void Cladogram::optimise_trees(set<Node *> &laidOut) {
+  int opt = optimise%10;
+  if(opt < 1) return;
+
+  int rCount = (int)roots.size();
+  vector<TreeJob> trees;
+  trees.reserve(rCount);  // a job is expensive to copy
+  int pos = 0;
+  for(int i = 0; i < rCount; ++i) {
+    Node * r = roots[i];
+    if(r->size > 1) {
+      trees.push_back(TreeJob());
+      TreeJob &job = trees.back();
+      job.clad = this;
+      job.root = r;
+      job.nodes.assign(nodes.begin() + pos, nodes.begin() + pos + r->size);
+      job.cached = false;
+      job.indexed = false;
+      job.deadline = (optimiseBudgetMs > 0) ? (optimiseDeadline) : (0);
+      job.passes = 0;
+      for(int j = 0; j < r->size; ++j)
+        job.children.push_back(job.nodes[j]->children);
+
+      // Trees which didn't change since the cached run keep their layout
+      if(layoutCache != "") {
+        job.key = layoutCache_treeKey(job.nodes);
+        map<string, TreeSnapshot>::iterator it = treeSnapshots.find(job.key);
+        if(it != treeSnapshots.end()) restoreTree(job, it->second);
+      }
+    }
+    pos += r->size;
+  }
+
+  vector<int> order;
+  for(int i = 0; i < (int)trees.size(); ++i)
+    order.push_back(i);
+  compareJobSize bySize;
+  bySize.trees = &trees;
+  stable_sort(order.begin(), order.end(), bySize);
+
+  int threads = std::min(jobs, (int)trees.size());
+  for(int step = -1; step <= 3; ++step) {
+#ifdef GNUCLAD_POSIX
+    if(threads > 1) {
+      TreeJobQueue queue;
+      queue.trees = &trees;
+      queue.order = &order;
+      queue.step = step;
+      queue.next = 0;
+      pthread_mutex_init(&queue.lock, NULL);
+      vector<pthread_t> pool(threads - 1);
+      int started = 0;
+      for(; started < threads - 1; ++started)
+        if(pthread_create(&pool[started], NULL, layoutTreeWorker, &queue) != 0)
+          break;
+      layoutTreeWorker(&queue);  // this thread takes part as well
+      for(int i = 0; i < started; ++i)
+        pthread_join(pool[i], NULL);
+      pthread_mutex_destroy(&queue.lock);
+      continue;
+    }
+#endif
+    for(int i = 0; i < (int)order.size(); ++i)
+      layoutTree(trees[order[i]], step);
+  }
+
+  // Put the map back together, in the same root order
+  bool escaped = false;
+  int offset = 0, t = 0;
+  pos = 0;
+  for(int i = 0; i < rCount; ++i) {
+    Node * r = roots[i];
+    if(r->size > 1) {
+      TreeJob &job = trees[t++];
+      passesTotal += treePassCount(opt);
+      if(job.escaped) escaped = true;
+      if(escaped == false) {
+        passesDone += (job.cached) ? (treePassCount(opt)) : (job.passes);
+        for(int j = 0; j < r->size; ++j) {
+          nodes[pos + j] = job.nodes[j];
+          nodes[pos + j]->offset += offset;
+        }
+        laidOut.insert(r);
+        offset += job.span;
+        pos += r->size;
+        continue;
+      }
+      for(int j = 0; j < r->size; ++j)
+        nodes[pos + j]->children = job.children[j];
+    }
+    for(int j = 0; j < r->size; ++j)
+      nodes[pos + j]->offset = offset + j;
+    offset += r->size;
+    pos += r->size;
+  }
+
+  // Trees cut short by the budget don't go into the cache
+  int cached = 0;
+  if(layoutCache != "") {
+    treeSnapshots.clear();
+    for(int i = 0; i < (int)trees.size(); ++i) {
+      if(trees[i].cached || trees[i].passes == treePassCount(opt))
+        treeSnapshots[trees[i].key] = trees[i].snapshot;
+      if(trees[i].cached) ++cached;
+    }
+  }
+
+  if(debug > 0)
+    cout << "\noptimise_trees: trees=" << trees.size()
+         << "  laid out=" << laidOut.size() << "  cached=" << cached
+         << "  threads=" << threads;
+}
+
 // Fill gaps within tree lines, interleave subtrees (only by 1 offset)
-void Cladogram::optimise_nextTree(int first, int last) {
+void Layout::optimise_nextTree(int first, int last) {
   Node * a;
   Node * b = nodes[first];
   for(int i = first; i < last - 1; ++i) {
 
     a = b;
     b = nodes[i + 1];
-    if(fitsInto(a->offset, b))
-      moveOffsetsHigherThan(b->offset - 1, -1);
+    if(fitsInto(lanes.offset(a), b))
+      moveOffsetsHigherThan(lanes.offset(b) - 1, -1);
 
   }
 }
 
 // Pull nodes to towards the root.
-void Cladogram::optimise_pullToRoot(int first, int last, bool stronger) {
+void Layout::optimise_pullToRoot(int first, int last, bool stronger) {
   Node * n;
   int sign = 0;
 
   // Sort by distance to root
-  stable_sort(nodes.begin()+first, nodes.begin()+last, compareRootDist());
+  lanes.materialize(nodes.begin()+first, nodes.begin()+last);
+  sortByKey(nodes.begin()+first, nodes.begin()+last, keyRootDist());
 
   for(int i = first; i < last; ++i) {
     n = nodes[i];
-    int rootOffset = n->root()->offset;
+    int rootOffset = lanes.offset(n->rootNode);
     if(n->parent == NULL) continue;
-    if(n->offset < rootOffset) sign = 1;
+    int offset = lanes.offset(n);
+    int parentOffset = lanes.offset(n->parent);
+    if(offset < rootOffset) sign = 1;
     else sign = -1;
 
-    int oldOffset = n->offset;
+    int oldOffset = offset;
     int maxOffset = 0;
     for(int j = first; j < last; ++j)
-      if(nodes[j]->offset > maxOffset) maxOffset = nodes[j]->offset;
+      if(lanes.offset(nodes[j]) > maxOffset) maxOffset=lanes.offset(nodes[j]);
 
-    while(fitsInto(n->offset + sign, n)) {
-      if(n->offset == rootOffset) break;
-      if(n->offset < 0) break;
-      if(n->offset > maxOffset) break;
-      if(stronger == false && n->offset == n->parent->offset) break;
+    while(fitsInto(offset + sign, n)) {
+      if(offset == rootOffset) break;
+      if(offset < 0) break;
+      if(offset > maxOffset) break;
+      if(stronger == false && offset == parentOffset) break;
 
       bool overlaps = optimise_strictOverlaps(n, oldOffset, sign, first, last);
-      if(overlaps == false) n->offset += sign;  // pull by one offset
+      if(overlaps == false) move(n, offset += sign);  // pull by one
       else break;
     }
 
     // Remove empty offsets
-    Node dummy;
-    dummy.offset = -1;
-    dummy.start = beginningOfTime;
-    dummy.stop = endOfTime;
-    if(fitsInto(oldOffset, &dummy)) moveOffsetsHigherThan(oldOffset, -1);
+    if(oldOffset != -1 && fitsInto(oldOffset, timeStartKey, timeStopKey))
+      moveOffsetsHigherThan(oldOffset, -1);
   }
 
   // Get nodes back into offset order
-  stable_sort(nodes.begin()+first, nodes.begin()+last, compareOffset());
+  lanes.materialize(nodes.begin()+first, nodes.begin()+last);
+  sortByKey(nodes.begin()+first, nodes.begin()+last, keyOffset());
 }
 
 // Pull nodes to their parents.
-void Cladogram::optimise_pullToParent(Node * r, int first, int last) {
+void Layout::optimise_pullToParent(Node * r, int first, int last) {
 
   if(r->size == 1) return;
 
@@ -885,30 +1525,31 @@ void Cladogram::optimise_pullToParent(Node * r, int first, int last) {
   int sign = 0;
 
   // Sort by distance to parent
-  stable_sort(r->children.begin(), r->children.end(), compareParDist());
+  lanes.materialize(r->children.begin(), r->children.end());
+  r->offset = lanes.offset(r);
+  sortByKey(r->children.begin(), r->children.end(), keyParDist());
 
   for(int i = 0; i < (int)r->children.size(); ++i) {
     n = r->children[i];
-    if(n->offset < n->parent->offset) sign = 1;
+    int offset = lanes.offset(n);
+    int parentOffset = lanes.offset(r);
+    if(offset < parentOffset) sign = 1;
     else sign = -1;
-    int oldOffset = n->offset;
+    int oldOffset = offset;
 
-    while(fitsInto(n->offset + sign, n)) {
-      if(n->offset < 0)break;
-      if(sign == -1 && n->offset <= r->offset - r->size) break;
-      if(sign ==  1 && n->offset >= r->offset + r->size) break;
+    while(fitsInto(offset + sign, n)) {
+      if(offset < 0)break;
+      if(sign == -1 && offset <= parentOffset - r->size) break;
+      if(sign ==  1 && offset >= parentOffset + r->size) break;
 
       bool overlaps = optimise_strictOverlaps(n, oldOffset, sign, first, last);
-      if(overlaps == false) n->offset += sign;
+      if(overlaps == false) move(n, offset += sign);
       else break;
     }
 
     // Remove empty offsets
-    Node dummy;
-    dummy.offset = -1;
-    dummy.start = beginningOfTime;
-    dummy.stop = endOfTime;
-    if(fitsInto(oldOffset, &dummy)) moveOffsetsHigherThan(oldOffset, -1);
+    if(oldOffset != -1 && fitsInto(oldOffset, timeStartKey, timeStopKey))
+      moveOffsetsHigherThan(oldOffset, -1);
 
   }
 
@@ -916,47 +1557,55 @@ void Cladogram::optimise_pullToParent(Node * r, int first, int last) {
     optimise_pullToParent(r->children[i], first, last);
 
   // Get children back into offset order
-  stable_sort(r->children.begin(), r->children.end(), compareOffset());
+  lanes.materialize(r->children.begin(), r->children.end());
+  sortByKey(r->children.begin(), r->children.end(), keyOffset());
 }
 
 // Aesthetical hack to prevent node lines overlapping deriv lines.
 // Returns false if specified node probably doesn't overlap other lines.
-bool Cladogram::optimise_strictOverlaps(Node * n, int oldOffset, int sign,
+bool Layout::optimise_strictOverlaps(Node * n, int oldOffset, int sign,
                                         int first, int last) {
-  if(strictOverlaps == 0) return false;
+  if(clad->strictOverlaps == 0) return false;
+  int derivType = clad->derivType;
   if(derivType < 1 || 5 < derivType) return false;
 
+  const LayoutCore &core = clad->core;
+  int index = n->index;
+  int offset = lanes.offset(n);
   double slope;
-  if(derivType == 1 || derivType == 5)
-    slope = double((n->offset - n->parent->offset)*offsetPX) * -sign /
-            datePX(n->stop + stopSpacing, this) - datePX(n->parent->start,this);
-  else
+  if(derivType == 1 || derivType == 5) {
+    // A parent is always kept with its children, so it's in the core
+    slope = double((offset - lanes.offset(n->parent))*clad->offsetPX) * -sign /
+            core.stopSpacedPX[index] - core.startPX[core.parent[index]];
+  } else
     slope = 0.6;
 
-  int addPX = int(offsetPX/slope * (n->offset - oldOffset        +1));
-  int stopPX = datePX(n->stop, this) + addPX;
-  int startPX = datePX(n->start, this);
+  int addPX = int(clad->offsetPX/slope * (offset - oldOffset        +1));
+  int stopPX = core.stopPX[index] + addPX;
+  int startPX = core.startPX[index];
 
   /////////////////////////
   // The following is an additional implementation of fitsInto(), based
   // on PX rather than Date. When moving into a function, use and modify
   // fitsInto() instead of this one (many checks removed)!
-  vector<Node *> tmp;
-  for(int i = first; i < last; ++i)
-    if(nodes[i]->offset == n->offset && nodes[i] != n)
-      tmp.push_back(nodes[i]);
+  // The lane is already sorted by start, only the nodes of the tree count.
+  const LaneIndex::Lane * lane = lanes.lane(offset);
+  if(lane == NULL || first >= last) return false;
+  Node * root = nodes[first]->rootNode;
+  vector<int> &tmp = overlapping;
+  tmp.clear();
+  for(LaneIndex::Lane::const_iterator it = lane->begin(); it != lane->end();
+      ++it)
+    if(it->node->rootNode == root && it->node != n)
+      tmp.push_back(it->node->index);
 
   if(tmp.size() == 0) return false;
 
-  sort(tmp.begin(), tmp.end(), compareDate());
-
-  if( stopPX < datePX(tmp[0]->start, this) ||
-      startPX > datePX(n->stop + stopSpacing, this) )
+  if( stopPX < core.startPX[tmp[0]] || startPX > core.stopSpacedPX[index] )
     return false;
 
   for(int i = 0; i < (int)tmp.size() - 2; ++i)
-    if( datePX(tmp[i]->stop + stopSpacing, this) < startPX &&
-        stopPX < datePX(tmp[i+1]->start, this))
+    if( core.stopSpacedPX[tmp[i]] < startPX && stopPX < core.startPX[tmp[i+1]] )
       return false;
 
   /////////////////////////
@@ -966,20 +1615,26 @@ bool Cladogram::optimise_strictOverlaps(Node * n, int oldOffset, int sign,
 
 // Change node array sequence to "pseudo-inverse" preorder
 // Fix for SVG layering (derivType 2 - 5)
+// Going backwards, a node is swapped with its parent as long as the parent
+// has a lower position, so that every node ends up before its parent. The
+// positions are kept by Node::index, the parent needn't be searched for.
 void Cladogram::nodesPreorder() {
   int dbg_counter = 0, dbg_swaps = 0;
+  vector<int> position(nodes.size());
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    position[nodes[i]->index] = i;
+
   for(int i = (int)nodes.size() - 1; i >= 0; --i) {
     Node * par = nodes[i]->parent;
     if( par == NULL) continue;
 
-    int j = (int)nodes.size();
-    while(--j >= 0) {  // find parent
-      dbg_counter++;
-      if(nodes[j] == par) break;
-    }
+    int j = position[par->index];  // find parent
+    dbg_counter++;
     if(j < i) {  // swap with parent if parent has lower position
       dbg_swaps++;
       swap(nodes[j], nodes[i]);
+      position[nodes[j]->index] = j;
+      position[nodes[i]->index] = i;
       ++i;
     }
 
@@ -988,3 +1643,299 @@ void Cladogram::nodesPreorder() {
     cout << "\nnodesPreorder: comparisons=" << dbg_counter
          << "  swaps=" << dbg_swaps;
 }
+
+
+// Accumulates the per-subtree aggregates bottom-up, by walking the preorder
+// backwards: the size (the node and all of its descendants) and the growth of
+// the line width caused by bigParent.
+void Cladogram::compute_subtreeAggregates() {
+
+  Node * n;
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    nodes[i]->size = 1;
+
+  for(int i = (int)tour.size() - 1; i >= 0; --i) {
+    n = tour[i];
+    if(n->parent != NULL)
+      n->parent->size += n->size;
+  }
+
+  // Nodes outside of the preorder still have to climb
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    n = nodes[i];
+    if(n->eulerIn >= 0) continue;
+    while(n->parent != NULL) {
+      n->parent->size += 1;
+      n = n->parent;
+    }
+  }
+
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    n = nodes[i];
+    n->lineGrowth = (sqrt(n->size)-1) * bigParent;
+  }
+}
+
+
+// Two FNV-1a hashes with different offset bases give a 64 bit key
+static string hashKey(const string &str) {
+  unsigned int h1 = 2166136261u, h2 = 3339675911u;
+  for(int i = 0; i < (int)str.size(); ++i) {
+    h1 = (h1 ^ (unsigned char)str[i]) * 16777619u;
+    h2 = (h2 ^ (unsigned char)str[i]) * 16777619u;
+  }
+  ostringstream hex;
+  hex << std::hex << h1 << '-' << h2;
+  return hex.str();
+}
+
+// Writes the nodes in the given order, with parents and children referred to by
+// their position in it
+static void writeNodes(ostringstream &key, vector<Node *> &order) {
+  map<Node *, int> pos;
+  for(int i = 0; i < (int)order.size(); ++i)
+    pos[order[i]] = i;
+
+  for(int i = 0; i < (int)order.size(); ++i) {
+    Node * n = order[i];
+    key << n->name << '\n' << (n->parentId == SymbolTable::empty) << ' '
+        << ((n->parent != NULL && pos.count(n->parent)) ? pos[n->parent] : -1)
+        << ' ' << n->start.year << '.' << n->start.month << '.' << n->start.day
+        << ' ' << n->stop.year << '.' << n->stop.month << '.' << n->stop.day
+        << ' ' << n->size;
+    for(int j = 0; j < (int)n->children.size(); ++j)
+      key << ' ' << (pos.count(n->children[j]) ? pos[n->children[j]] : -1);
+    key << '\n';
+  }
+}
+
+// Hashes a single root tree as it is before the layout, together with all
+// options its own layout depends on
+std::string Cladogram::layoutCache_treeKey(vector<Node *> &tree) {
+  ostringstream key;
+  key << gnuclad_version << ' ' << treeMode << ' ' << optimise << ' '
+      << strictOverlaps << ' ' << derivType << ' '
+      << stopSpacing.year << '.' << stopSpacing.month << '.' << stopSpacing.day
+      << ' ' << offsetPX << ' ' << yearPX << ' ' << monthsInYear << ' '
+      << daysInMonth << ' ' << Date2str(beginningOfTime) << ' '
+      << Date2str(endOfTime) << '\n';
+  writeNodes(key, tree);
+  return hashKey(key.str());
+}
+
+// Hashes the nodes, domains and connectors as they are right before the
+// layout, together with all options the layout depends on
+std::string Cladogram::layoutCache_key(vector<Node *> &order) {
+  map<Node *, int> pos;
+  for(int i = 0; i < (int)order.size(); ++i)
+    pos[order[i]] = i;
+
+  ostringstream key;
+  key << gnuclad_version << ' ' << treeMode << ' ' << sortKey << ' '
+      << optimise << ' ' << strictOverlaps << ' ' << packSingleRoots << ' '
+      << derivType << ' ' << treeSpacing << ' ' << treeSpacingBiggerThan << ' '
+      << stopSpacing.year << '.' << stopSpacing.month << '.' << stopSpacing.day
+      << ' ' << offsetPX << ' ' << lineWidth << ' ' << yearPX << ' '
+      << monthsInYear << ' ' << daysInMonth << ' ' << tighterDomains << ' '
+      << Date2str(beginningOfTime) << ' ' << Date2str(endOfTime) << ' ';
+  key.precision(17);
+  key << bigParent << '\n';
+  writeNodes(key, order);
+  for(int i = 0; i < (int)domains.size(); ++i)
+    key << 'd' << pos[domains[i]->node] << '\n';
+  for(int i = 0; i < (int)connectors.size(); ++i)
+    key << 'c' << pos[connectors[i]->from] << ' ' << pos[connectors[i]->to]
+        << '\n';
+
+  return hashKey(key.str());
+}
+
+// Restores the layout from the cache file if its key matches. Returns false
+// and leaves everything untouched otherwise. The snapshots of single trees are
+// loaded in any case, unless the file comes from another gnuclad version.
+bool Cladogram::layoutCache_load(const std::string key,
+                                 vector<Node *> &order) {
+  ifstream fp(layoutCache.c_str());
+  if( !(fp.is_open()) ) return false;
+
+  int count = (int)order.size();
+  string line, version, storedKey, label;
+  getline(fp, line);
+  getline(fp, version);
+  getline(fp, storedKey);
+  if(line != "gnuclad layout cache" || version != gnuclad_version)
+    return false;
+
+  int maxOffset = 0, size = 0, index = 0, treeCount = 0;
+  fp >> label >> treeCount;
+  if(label != "trees") return false;
+  for(int i = 0; i < treeCount && fp; ++i) {
+    string treeKey;
+    TreeSnapshot snap;
+    int escaped = 0;
+    fp >> treeKey >> size >> snap.span >> escaped;
+    if(!fp || size < 0 || size > count) break;
+    snap.escaped = (escaped != 0);
+    snap.order.resize(size);
+    snap.offsets.resize(size);
+    snap.children.resize(size);
+    for(int j = 0; j < size; ++j)
+      fp >> snap.order[j] >> snap.offsets[j];
+    for(int j = 0; j < size && fp; ++j) {
+      int c = 0;
+      fp >> c;
+      for(int k = 0; k < c && fp; ++k) {
+        fp >> index;
+        snap.children[j].push_back(index);
+      }
+    }
+    if(fp) treeSnapshots[treeKey] = snap;
+  }
+
+  if(storedKey != key) {
+    if(debug > 0) cout << "\nlayoutCache: " << layoutCache << " is outdated";
+    return false;
+  }
+
+  fp >> label >> maxOffset;
+  if(label != "maximumOffset") return false;
+
+  vector<Node *> placed;
+  vector<int> offsets;
+  fp >> label >> size;
+  if(label != "nodes" || size != count) return false;
+  for(int i = 0; i < size; ++i) {
+    int offset = 0;
+    fp >> index >> offset;
+    if(!fp || index < 0 || index >= count) return false;
+    placed.push_back(order[index]);
+    offsets.push_back(offset);
+  }
+
+  vector<Node *> rootOrder;
+  fp >> label >> size;
+  if(label != "roots" || size < 0 || size > count) return false;
+  for(int i = 0; i < size; ++i) {
+    fp >> index;
+    if(!fp || index < 0 || index >= count) return false;
+    rootOrder.push_back(order[index]);
+  }
+
+  vector< pair<Node *, vector<Node *> > > childOrders;
+  fp >> label >> size;
+  if(label != "children") return false;
+  for(int i = 0; i < size; ++i) {
+    int c = 0;
+    fp >> index >> c;
+    if(!fp || index < 0 || index >= count ||
+       c != (int)order[index]->children.size()) return false;
+    childOrders.push_back( make_pair(order[index], vector<Node *>()) );
+    for(int j = 0; j < c; ++j) {
+      int child = 0;
+      fp >> child;
+      if(!fp || child < 0 || child >= count) return false;
+      childOrders.back().second.push_back(order[child]);
+    }
+  }
+
+  vector<int> dOffsets, cOffsets;
+  fp >> label >> size;
+  if(label != "domains" || size != (int)domains.size()) return false;
+  for(int i = 0; i < 2 * size; ++i) {
+    int offset = 0;
+    fp >> offset;
+    dOffsets.push_back(offset);
+  }
+  fp >> label >> size;
+  if(label != "connectors" || size != (int)connectors.size()) return false;
+  for(int i = 0; i < 2 * size; ++i) {
+    int offset = 0;
+    fp >> offset;
+    cOffsets.push_back(offset);
+  }
+  if(!fp) return false;
+
+  nodes.swap(placed);
+  for(int i = 0; i < count; ++i)
+    nodes[i]->offset = offsets[i];
+  roots.swap(rootOrder);
+  for(int i = 0; i < (int)childOrders.size(); ++i)
+    childOrders[i].first->children.swap(childOrders[i].second);
+  for(int i = 0; i < (int)domains.size(); ++i) {
+    domains[i]->offsetA = dOffsets[2*i];
+    domains[i]->offsetB = dOffsets[2*i+1];
+  }
+  for(int i = 0; i < (int)connectors.size(); ++i) {
+    connectors[i]->offsetA = cOffsets[2*i];
+    connectors[i]->offsetB = cOffsets[2*i+1];
+  }
+  maximumOffset = maxOffset;
+
+  if(debug > 0) cout << "\nlayoutCache: reusing " << layoutCache;
+  return true;
+}
+
+// Writes the layout to the cache file, nodes are referred to by their
+// position in the given order (the one before the layout)
+void Cladogram::layoutCache_store(const std::string key,
+                                  vector<Node *> &order) {
+  map<Node *, int> pos;
+  for(int i = 0; i < (int)order.size(); ++i)
+    pos[order[i]] = i;
+
+  ofstream fp(layoutCache.c_str());
+  if( !(fp.is_open()) ) {
+    cout << "\nWarning: unable to write layout cache " << layoutCache;
+    return;
+  }
+
+  fp << "gnuclad layout cache\n" << gnuclad_version << '\n' << key << '\n';
+
+  fp << "trees " << treeSnapshots.size() << '\n';
+  map<string, TreeSnapshot>::iterator it;
+  for(it = treeSnapshots.begin(); it != treeSnapshots.end(); ++it) {
+    TreeSnapshot &snap = it->second;
+    fp << it->first << ' ' << snap.order.size() << ' ' << snap.span << ' '
+       << snap.escaped << '\n';
+    for(int i = 0; i < (int)snap.order.size(); ++i)
+      fp << snap.order[i] << ' ' << snap.offsets[i] << '\n';
+    for(int i = 0; i < (int)snap.children.size(); ++i) {
+      fp << snap.children[i].size();
+      for(int j = 0; j < (int)snap.children[i].size(); ++j)
+        fp << ' ' << snap.children[i][j];
+      fp << '\n';
+    }
+  }
+
+  fp << "maximumOffset " << maximumOffset << '\n';
+
+  fp << "nodes " << nodes.size() << '\n';
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    fp << pos[nodes[i]] << ' ' << nodes[i]->offset << '\n';
+
+  fp << "roots " << roots.size() << '\n';
+  for(int i = 0; i < (int)roots.size(); ++i)
+    fp << pos[roots[i]] << '\n';
+
+  int parents = 0;
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    if(nodes[i]->children.size() > 1) ++parents;
+  fp << "children " << parents << '\n';
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    Node * n = nodes[i];
+    if(n->children.size() < 2) continue;
+    fp << pos[n] << ' ' << n->children.size();
+    for(int j = 0; j < (int)n->children.size(); ++j)
+      fp << ' ' << pos[n->children[j]];
+    fp << '\n';
+  }
+
+  fp << "domains " << domains.size() << '\n';
+  for(int i = 0; i < (int)domains.size(); ++i)
+    fp << domains[i]->offsetA << ' ' << domains[i]->offsetB << '\n';
+  fp << "connectors " << connectors.size() << '\n';
+  for(int i = 0; i < (int)connectors.size(); ++i)
+    fp << connectors[i]->offsetA << ' ' << connectors[i]->offsetB << '\n';
+
+  if(debug > 0) cout << "\nlayoutCache: stored " << layoutCache;
+}
@@ -21,6 +21,20 @@
 
 #include <iostream>
 #include <limits>
+#include <ctime>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef GNUCLAD_POSIX
+#include <sys/time.h>
+#endif
+#if defined (GNUCLAD_AVX2)
+#include <immintrin.h>
+#elif defined (GNUCLAD_SSE2)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -109,6 +123,23 @@ void explode(const string str, const char delimiter, vector<string> * v) {
   if(buff != "") v->push_back(buff);
 }
 
+// One step of explodeSafely at position i, which must hold a delimiter or a
+// toggle: the other bytes never change the state, so the vector paths below
+// only visit those
+static inline void explodeStep(const char * str, const int len, const int i,
+                               const char delimiter, const char toggle,
+                               bool & t, int & start,
+                               vector<StringSlice> * v) {
+  if(str[i] == toggle) {  // only toggle off if we have delimiter after toggle
+    if(t == false) t = true;
+    if(t == true && i < len-1 && str[i+1] == delimiter) t = false;
+  }
+  if(str[i] == delimiter && t == false) {
+    v->push_back( StringSlice(str + start, i - start) );
+    start = i + 1;
+  }
+}
+
 // Explode, but not within the "safe" sequence
 // Attention: Fails if the "safe" sequence contains the toggle itself and
 // then the delimiter right behind
@@ -118,24 +149,49 @@ void explode(const string str, const char delimiter, vector<string> * v) {
 // Result 1: [abc] [*dexf|ghi*] [jkl]
 // Result 2: [abc] [*de*f|ghi*] [jkl]
 // Result 3: [abc] [*def*] [ghi*|jkl]
-void explodeSafely(const string str, const char delimiter, const char toggle,
-                   vector<string> * v) {
-  string buff = "";
+// The pieces are slices of str, which isn't copied.
+void explodeSafely(const char * str, const int len, const char delimiter,
+                   const char toggle, vector<StringSlice> * v) {
+  int start = 0;
   bool t = false;
-  int len = (int)str.length();
-  for(int i = 0; i < len; ++i) {
-
-    if(str[i] == toggle) {  // only toggle off if we have delimiter after toggle
-      if(t == false) t = true;
-      if(t == true && i < len-1 && str[i+1] == delimiter) t = false;
-    }
-    if(str[i] == delimiter && t == false) {
-      v->push_back(buff);
-      buff = "";
-    } else buff += str[i];
-
+  int i = 0;
+
+#ifdef GNUCLAD_AVX2
+  const __m256i d32 = _mm256_set1_epi8(delimiter);
+  const __m256i t32 = _mm256_set1_epi8(toggle);
+  for(; i + 32 <= len; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)(str + i));
+    unsigned int m = (unsigned int)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(b, d32), _mm256_cmpeq_epi8(b, t32)));
+    for(; m != 0; m &= m - 1)
+      explodeStep(str, len, i + __builtin_ctz(m), delimiter, toggle,
+                  t, start, v);
   }
-  if(buff != "") v->push_back(buff);
+#endif
+#ifdef GNUCLAD_SSE2
+  const __m128i d16 = _mm_set1_epi8(delimiter);
+  const __m128i t16 = _mm_set1_epi8(toggle);
+  for(; i + 16 <= len; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(str + i));
+    unsigned int m = (unsigned int)_mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(b, d16), _mm_cmpeq_epi8(b, t16)));
+    for(; m != 0; m &= m - 1)
+      explodeStep(str, len, i + __builtin_ctz(m), delimiter, toggle,
+                  t, start, v);
+  }
+#endif
+
+  for(; i < len; ++i)
+    if(str[i] == delimiter || str[i] == toggle)
+      explodeStep(str, len, i, delimiter, toggle, t, start, v);
+  if(start < len) v->push_back( StringSlice(str + start, len - start) );
+}
+void explodeSafely(const string str, const char delimiter, const char toggle,
+                   vector<string> * v) {
+  vector<StringSlice> slices;
+  explodeSafely(str.data(), (int)str.size(), delimiter, toggle, &slices);
+  for(int i = 0; i < (int)slices.size(); ++i)
+    v->push_back(slices[i].str());
 }
 
 
@@ -152,12 +208,142 @@ std::string findReplace(std::string str, std::string find, std::string replace){
 
 }
 
+// Returns true if c is white space, as skipped by the stream extractors
+static inline bool isSpace(const char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns the value of the digit c in base 10 or 16, -1 if it isn't one
+static inline int digitValue(const char c, const int base) {
+  int v = -1;
+  if     (c >= '0' && c <= '9') v = c - '0';
+  else if(c >= 'a' && c <= 'f') v = c - 'a' + 10;
+  else if(c >= 'A' && c <= 'F') v = c - 'A' + 10;
+  return (v < base) ? (v) : (-1);
+}
+
+// Parses an integer of the given base like the stream extractor does: leading
+// white space, a sign and for base 16 a 0x are skipped and the first non-digit
+// ends the number. Returns false if there are no digits or the number doesn't
+// fit an int.
+static bool parseInteger(const StringSlice s, const int base, int * n) {
+  int i = 0;
+  while(i < s.size && isSpace(s.data[i])) ++i;
+  bool negative = false;
+  if(i < s.size && (s.data[i] == '-' || s.data[i] == '+'))
+    negative = (s.data[i++] == '-');
+  if(base == 16 && i + 1 < s.size && s.data[i] == '0' &&
+     (s.data[i+1] == 'x' || s.data[i+1] == 'X'))
+    i += 2;
+
+  const unsigned int limit = (negative) ? (0u - (unsigned int)INT_MIN)
+                                        : ((unsigned int)INT_MAX);
+  unsigned int value = 0;
+  int digits = 0;
+  for(; i < s.size; ++i, ++digits) {
+    int v = digitValue(s.data[i], base);
+    if(v < 0) break;
+    if(value > (limit - v) / base) return false;
+    value = value * base + v;
+  }
+  if(digits == 0) return false;
+
+  if(negative && value != 0) *n = -(int)(value - 1) - 1;
+  else *n = (int)value;
+  return true;
+}
+
+// Parses a decimal integer, see parseInteger()
+bool parseInt(const StringSlice s, int * n) {
+  return parseInteger(s, 10, n);
+}
+
+// Parses a floating point number like the stream extractor does. The number
+// is scanned here and only its characters get handed to strtod.
+bool parseDouble(const StringSlice s, double * d) {
+  int i = 0;
+  while(i < s.size && isSpace(s.data[i])) ++i;
+  int begin = i;
+  if(i < s.size && (s.data[i] == '-' || s.data[i] == '+')) ++i;
+  int digits = 0;
+  for(; i < s.size && digitValue(s.data[i], 10) >= 0; ++i) ++digits;
+  if(i < s.size && s.data[i] == '.')
+    for(++i; i < s.size && digitValue(s.data[i], 10) >= 0; ++i) ++digits;
+  if(digits == 0) return false;
+  if(i < s.size && (s.data[i] == 'e' || s.data[i] == 'E')) {
+    ++i;
+    if(i < s.size && (s.data[i] == '-' || s.data[i] == '+')) ++i;
+    int expDigits = 0;
+    for(; i < s.size && digitValue(s.data[i], 10) >= 0; ++i) ++expDigits;
+    if(expDigits == 0) return false;
+  }
+
+  char buff[64];
+  std::string longNumber;
+  const char * number = buff;
+  if(i - begin < (int)sizeof(buff)) {
+    memcpy(buff, s.data + begin, i - begin);
+    buff[i - begin] = '\0';
+  } else {
+    longNumber.assign(s.data + begin, i - begin);
+    number = longNumber.c_str();
+  }
+  double value = strtod(number, NULL);
+  if(value == HUGE_VAL || value == -HUGE_VAL) return false;
+  *d = value;
+  return true;
+}
+
+// Parses a date of the format year[.month[.day]]. As with explode(), a trailing
+// dot is ignored and more than three parts leave the day unset.
+bool parseDate(const StringSlice s, Date * d) {
+  StringSlice part[3];
+  int count = 0;
+  int start = 0;
+  for(int i = 0; i <= s.size; ++i) {
+    if(i < s.size && s.data[i] != '.') continue;
+    if(i == s.size && i == start) break;
+    if(count < 3) part[count] = StringSlice(s.data + start, i - start);
+    ++count;
+    start = i + 1;
+  }
+
+  Date date;
+  if(count == 3) {
+    if(!parseInt(part[2], &date.day)) return false;
+    date.dayset = true;
+  }
+  if(count >= 2) {
+    if(!parseInt(part[1], &date.month)) return false;
+    date.monthset = true;
+  }
+  if(count >= 1 && !parseInt(part[0], &date.year)) return false;
+  *d = date;
+  return true;
+}
+
+// Parses a hex color of the format #abc or #abcdef. The hues are read like
+// hex2rgbHue() does and have to be within 0 and 255.
+bool parseColor(const StringSlice s, Color * c) {
+  if(s.size != 4 && s.size != 7) return false;
+  if(s.data[0] != '#') return false;
+  int l = (s.size - 1) / 3;
+  int hue[3];
+  for(int i = 0; i < 3; ++i)
+    if(!parseInteger(StringSlice(s.data + 1 + i*l, l), 16, &hue[i]) ||
+       hue[i] < 0 || hue[i] > 255)
+      return false;
+  c->red = hue[0];
+  c->green = hue[1];
+  c->blue = hue[2];
+  c->hex.assign(s.data + 1, s.size - 1);
+  return true;
+}
+
 // Converts a string to a double
 double str2double(const std::string str) {
-  std::istringstream ss (str);
   double d;
-  ss >> d;
-  if(ss.fail() == true) {
+  if(!parseDouble(str, &d)) {
     cout << "\nError: string to double conversion failed!";
     throw 0;
   }
@@ -166,16 +352,25 @@ double str2double(const std::string str) {
 
 // Converts a string to an integer
 int str2int(const std::string str) {
-  std::istringstream ss (str);
   int n;
-  ss >> n;
-  if(ss.fail() == true) {
+  if(!parseInt(str, &n)) {
     cout << "\nError: string to int conversion failed!";
     throw 0;
   }
   return n;
 }
 
+// Returns the wall clock time in milliseconds, falling back to processor time
+double wallClockMs() {
+#ifdef GNUCLAD_POSIX
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+  return clock() * 1000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
 // Converts an integer to a string
 std::string int2str(const int n) {
   std::ostringstream ss;
@@ -257,17 +452,52 @@ int datePX(Date d, Cladogram * clad) {
 // Use only if really needed (for comparisons), because you usually don't want
 // to equalise 2000.1.31 with 2000.2.1 if your daysInMonth is 30
 Date rOf(Date d, int monthsInYear, int daysInMonth) {
-  while(d.day > daysInMonth) {
-    d.month += 1;
-    d.day -= daysInMonth;
+  if(d.day > daysInMonth) {
+    d.month += (d.day - 1) / daysInMonth;
+    d.day = (d.day - 1) % daysInMonth + 1;
   }
-  while(d.month > monthsInYear) {
-    d.year += 1;
-    d.month -= monthsInYear;
+  if(d.month > monthsInYear) {
+    d.year += (d.month - 1) / monthsInYear;
+    d.month = (d.month - 1) % monthsInYear + 1;
   }
   return d;
 }
 
+// Sorts the pairs by ascending key, keeping the order of equal keys. Short
+// ranges get an insertion sort, longer ones a radix sort over the key bytes.
+void radixSort(std::vector< std::pair<int, Node *> > &items) {
+  int size = (int)items.size();
+  if(size < 32) {
+    for(int i = 1; i < size; ++i) {
+      std::pair<int, Node *> item = items[i];
+      int j = i;
+      for(; j > 0 && item.first < items[j-1].first; --j)
+        items[j] = items[j-1];
+      items[j] = item;
+    }
+    return;
+  }
+
+  std::vector< std::pair<int, Node *> > tmp(size);
+  std::vector<unsigned char> digit(size);  // of the keys with flipped sign bit
+  for(int shift = 0; shift < 32; shift += 8) {
+    int count[257] = { 0 };
+    for(int i = 0; i < size; ++i) {
+      digit[i] = ((items[i].first ^ 0x80000000u) >> shift) & 0xff;
+      ++count[digit[i] + 1];
+    }
+    bool same = false;  // all keys share this byte
+    for(int b = 1; b <= 256; ++b)
+      if(count[b] == size) same = true;
+    if(same) continue;
+    for(int b = 1; b <= 256; ++b)
+      count[b] += count[b-1];
+    for(int i = 0; i < size; ++i)
+      tmp[count[digit[i]]++] = items[i];
+    items.swap(tmp);
+  }
+}
+
 // Returns the supplied color string if it is in a valid hex color format
 // Doesn't check for value boundaries. It's called by the Color constructor and
 // shouldn't be used in parsers/generators.
@@ -285,29 +515,105 @@ std::string checkHexCol(const std::string color) {
 // Returns the hex value of a suppied RGB hue integer. It's called by the
 // Color constructor and shouldn't be used in parsers/generators.
 std::string rgb2hexHue(int hue) {
-  std::stringstream ss;
-  std::string hhue;
-  ss << std::hex << hue;
-  ss >> hhue;
-  if(hhue.size() == 1) hhue = "0" + hhue;
-
-  if(ss.fail() == true) {
-    cout << "\nError: Color RGB to hex conversion failed: bad hue!";
-    throw 0;
-  }
-  return hhue;
+  static const char digits[] = "0123456789abcdef";
+  unsigned int u = (unsigned int)hue;
+  char buff[2 * sizeof(u)];
+  int pos = sizeof(buff);
+  do {
+    buff[--pos] = digits[u & 15];
+    u >>= 4;
+  } while(u != 0);
+  if(pos == (int)sizeof(buff) - 1) buff[--pos] = '0';
+  return std::string(buff + pos, sizeof(buff) - pos);
 }
 
 // Returns the RGB integer value of a suppied hex hue. It's called by the
 // Color constructor and shouldn't be used in parsers/generators.
 int hex2rgbHue(std::string hhue) {
-  std::stringstream ss;
   int hue;
-  ss << std::hex << hhue;
-  ss >> hue;
-  if(ss.fail() == true) {
+  if(!parseInteger(hhue, 16, &hue)) {
     cout << "\nError: Color hex to RGB conversion failed: bad hue!";
     throw 0;
   }
   return hue;
 }
+
+// Returns the date packed into a single number for the binary dataset format:
+// the year in the upper 16 bits, then month and day with 7 bits each and the
+// monthset and dayset flags
+int packDate(const Date d) {
+  if(d.year < -32768 || d.year > 32767 ||
+     d.month < 0 || d.month > 127 || d.day < 0 || d.day > 127)
+    throw "date " + Date2str(d) + " can't be stored in binary format";
+  unsigned int n = ((unsigned int)d.year & 0xffff) << 16;
+  n |= (unsigned int)d.month << 9 | (unsigned int)d.day << 2;
+  n |= (unsigned int)d.monthset << 1 | (unsigned int)d.dayset;
+  return (int)n;
+}
+
+// Returns the date packed by packDate()
+Date unpackDate(const int n) {
+  unsigned int u = (unsigned int)n;
+  Date d;
+  d.year = (int)(u >> 16);
+  if(d.year > 32767) d.year -= 65536;
+  d.month = (u >> 9) & 127;
+  d.day = (u >> 2) & 127;
+  d.monthset = (u & 2) != 0;
+  d.dayset = (u & 1) != 0;
+  return d;
+}
+
+// Returns the color packed into a single number for the binary dataset format,
+// keeping its hex notation: the hex digits in the lower 24 bits, a flag for
+// every upper case digit above that and a flag for the short #abc form
+int packColor(const Color c) {
+  int len = (int)c.hex.size();
+  if(len != 3 && len != 6)
+    throw "color #" + c.hex + " can't be stored in binary format";
+  unsigned int n = (len == 3) ? (1u << 30) : (0);
+  for(int i = 0; i < len; ++i) {
+    char ch = c.hex[i];
+    unsigned int v;
+    if     (ch >= '0' && ch <= '9') v = ch - '0';
+    else if(ch >= 'a' && ch <= 'f') v = ch - 'a' + 10;
+    else if(ch >= 'A' && ch <= 'F') { v = ch - 'A' + 10; n |= 1u << (24 + i); }
+    else throw "color #" + c.hex + " can't be stored in binary format";
+    n |= v << (4 * (5 - i));
+  }
+  return (int)n;
+}
+
+// Returns the color packed by packColor()
+Color unpackColor(const int n) {
+  static const char lower[] = "0123456789abcdef";
+  static const char upper[] = "0123456789ABCDEF";
+  unsigned int u = (unsigned int)n;
+  int len = (u & (1u << 30)) ? (3) : (6);
+  int l = len / 3;
+  Color c;
+  c.hex = string(len, '0');
+  int hue[3] = {0, 0, 0};
+  for(int i = 0; i < len; ++i) {
+    unsigned int v = (u >> (4 * (5 - i))) & 15;
+    c.hex[i] = (u & (1u << (24 + i))) ? (upper[v]) : (lower[v]);
+    hue[i / l] = hue[i / l] * 16 + v;
+  }
+  c.red = hue[0];
+  c.green = hue[1];
+  c.blue = hue[2];
+  return c;
+}
+
+// Appends n to buf as 4 bytes, little endian
+void putInt32(std::vector<char> &buf, const int n) {
+  unsigned int u = (unsigned int)n;
+  for(int i = 0; i < 4; ++i)
+    buf.push_back((char)((u >> (8 * i)) & 0xff));
+}
+
+// Returns the 4 byte little endian number at p
+int getInt32(const char * p) {
+  const unsigned char * b = (const unsigned char *)p;
+  return (int)(b[0] | b[1] << 8 | b[2] << 16 | (unsigned int)b[3] << 24);
+}
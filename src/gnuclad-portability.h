@@ -27,6 +27,13 @@
 #define GNUCLAD_POSIX
 #endif
 
+#if defined (__GNUC__) && defined (__AVX2__)
+#define GNUCLAD_AVX2
+#endif
+#if defined (__GNUC__) && defined (__SSE2__)
+#define GNUCLAD_SSE2
+#endif
+
 
 #include <string>
 #include <dirent.h>
@@ -25,15 +25,26 @@
 #include "gnuclad.h"
 #include "parser/csv.h"
 #include "parser/dir.h"
+#include "parser/gcb.h"
 #include "generator/csv.h"
 #include "generator/svg.h"
 #include "generator/conf.h"
 #include "generator/png.h"
+#include "generator/gcb.h"
 
 #include "../config.h"
 
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <cstring>
+
+#ifdef GNUCLAD_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 //~ #include <cstdlib>
 //~ #include <cstring>
 //~ #include <ctime>
@@ -49,12 +60,32 @@ int main(int argc, char ** argv) {
 
   const string version = VERSION;
   string conffile = "";
-  string inFormats = "csv, [directory]";
-  string outFormats = "csv, svg, conf";
+  string inFormats = "csv, gcb, [directory]";
+  string outFormats = "csv, svg, conf, gcb";
 
   // Print version
   cout << "gnuclad " << version;
 
+  // Take out the --jobs option, the remaining arguments are positional
+  int jobs = 1;
+  bool badJobs = false;
+  vector<char *> args;
+  for(int i = 0; i < argc; ++i) {
+    string arg = argv[i];
+    if((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+      string val = argv[++i];
+      if(parseInt(val, &jobs) == false || jobs < 1) {
+        cout << "\nError: invalid number of jobs: " << val;
+        badJobs = true;
+        jobs = 1;
+      }
+      continue;
+    }
+    args.push_back(argv[i]);
+  }
+  argc = (int)args.size();
+  argv = &args[0];
+
   string a1;
   if(argc > 1) a1 = argv[1];
   if(a1 == "-v" || a1 == "--version") {
@@ -64,15 +95,19 @@ int main(int argc, char ** argv) {
 
   // Print help
   string self = getBaseName(argv[0]);
-  if( (argc != 3 && argc != 4) || a1 == "-h" || a1 == "--help" ) {
+  if( (argc != 3 && argc != 4) || a1 == "-h" || a1 == "--help" || badJobs ) {
 
-    cout << "\nUsage: " << self<<" INPUTFILE OUTPUT[FORMAT|FILE] [CONFIGFILE]\n"
+    cout << "\nUsage: " << self<<" [--jobs N] INPUTFILE OUTPUT[FORMAT|FILE] [CONFIGFILE]\n"
          << " Example: " << self << " table.CSV SVG\n"
-         << " Example: " << self << " Data.csv result.csv alternative.conf\n\n"
+         << " Example: " << self << " Data.csv result.csv alternative.conf\n"
+         << " Example: " << self << " --jobs 4 Data.csv SVG\n\n"
+         << "Options:\n"
+         << "  -j, --jobs N    read CSV input and lay out independent trees on N\n"
+         << "                  threads\n\n"
          << "Supported input formats: " << inFormats << '\n'
          << "Supported output formats: " << outFormats << "\n"
          << "Please consult the Texinfo manual for in-depth explanations.\n\n";
-    return EXIT_SUCCESS;
+    return (badJobs) ? (EXIT_FAILURE) : (EXIT_SUCCESS);
 
   }
 
@@ -93,6 +128,7 @@ int main(int argc, char ** argv) {
   // Chose parser
   Parser * parser = NULL;
   if     (inputExt == "csv") parser = new ParserCSV;
+  else if(inputExt == "gcb") parser = new ParserGCB;
   else if(inputExt == "")    parser = new ParserDIR;
   else {
     cout << "\nError: unknown input file type: " << inputExt << '\n'
@@ -106,6 +142,7 @@ int main(int argc, char ** argv) {
   else if(outputExt == "svg")  generator = new GeneratorSVG;
   else if(outputExt == "conf") generator = new GeneratorCONF;
   else if(outputExt == "png")  generator = new GeneratorPNG;
+  else if(outputExt == "gcb")  generator = new GeneratorGCB;
   else {
     cout << "\nError: unknown output file type: " << outputExt << '\n'
          << "Supported output formats: " << outFormats << '\n';
@@ -118,6 +155,7 @@ int main(int argc, char ** argv) {
 	clad = new Cladogram();
   clad->gnuclad_version = version;
   clad->inputFolder = getBaseFolder(source);
+  clad->jobs = jobs;
 
   int exitval = EXIT_FAILURE;
   cout << ": " << source << " => " << dest;
@@ -130,6 +168,7 @@ int main(int argc, char ** argv) {
     InputFile in(source);
     parser->parseData(clad, in);
     safeClose(in.p);  // if we want to write to the same file
+    generator->keepParsedData(clad);
 
     clad->compute();
 
@@ -189,13 +228,12 @@ Color::Color(int tred, int tgreen, int tblue) {
   hex = hred + hgreen + hblue;
 }
 Color::Color(string thex) {
-  hex = checkHexCol(thex);
-  hex = hex.substr(1);
-
-  int l = 0;
-  if(hex.size() == 3) l = 1;
-  else if(hex.size() == 6) l = 2;
+  checkHexCol(thex);
+  if(parseColor(thex, this)) return;
 
+  // Go through the hues one by one, for the error message of the bad one
+  hex = thex.substr(1);
+  int l = (hex.size() == 3) ? (1) : (2);
   red = hex2rgbHue( hex.substr(0, l) );
   green = hex2rgbHue( hex.substr(l, l) );
   blue = hex2rgbHue( hex.substr(2*l, l) );
@@ -226,33 +264,30 @@ Date::Date() {
   *this = Date(0, 0, 0);
 }
 Date::Date(const std::string str) {
-  year = 0; month = 0; day = 0;
-  monthset = false; dayset = false;
-  vector<string> d;
-  explode(str, '.', &d);
-  if(d.size() == 3) {
-    day = str2int(d[2]);
-    dayset = true;
-  }
-  if(d.size() >= 2) {
-    month = str2int(d[1]);
-    monthset = true;
+  if(!parseDate(str, this)) {
+    cout << "\nError: string to int conversion failed!";
+    throw 0;
   }
-  if(d.size() >= 1) year = str2int(d[0]);
 }
-bool Date::operator<(const Date d) {
+bool Date::operator<(const Date d) const {
   if(year < d.year ||
     (year == d.year && month < d.month) ||
     (year == d.year && month == d.month && day < d.day) )
     return true;
   else return false;
 }
-bool Date::operator==(Date d) {
+bool Date::operator==(Date d) const {
   return ( !(*this < d)&& !(d < *this) );
 }
 Date Date::operator+(const Date d) {
   return Date(d.year + year, d.month + month, d.day + day);
 }
+// Returns the date packed into a single number. Unset months and days (0) get
+// their own slot, so as long as month and day don't exceed the given maxima,
+// the numbers are ordered like operator<.
+int Date::serial(int maxMonth, int maxDay) const {
+  return (year * (maxMonth + 1) + month) * (maxDay + 1) + day;
+}
 
 NameChange::NameChange() {}
 NameChange::NameChange(std::string tnewName, Date tdate,
@@ -268,6 +303,7 @@ Image::Image() {
 }
 
 Domain::Domain() {
+  nodeId = SymbolTable::empty;
   intensity = 50;
   node = NULL;
 }
@@ -275,7 +311,16 @@ Domain::Domain() {
 Node::Node() {
   offset = 0;
   size = 1;
+  lineGrowth = 0;
+  nameId = SymbolTable::empty;
+  parentId = SymbolTable::empty;
+  index = -1;
+  lane = -1;
   parent = NULL;
+  rootNode = NULL;
+  depth = 0;
+  eulerIn = -1;
+  eulerOut = -1;
 }
 
 void Node::addNameChange(std::string newName, Date date,
@@ -290,6 +335,8 @@ Node * Node::root() {
 }
 
 bool Node::derivesFrom(Node * p) {
+  if(eulerIn >= 0 && p->eulerIn >= 0)  // subtree intervals are known
+    return p->eulerIn < eulerIn && eulerOut <= p->eulerOut;
   Node * n = this;
   while(n->parent != NULL) {
     if(p == n->parent) return true;
@@ -298,7 +345,373 @@ bool Node::derivesFrom(Node * p) {
   return false;
 }
 
+const int SymbolTable::empty;
+
+SymbolTable::SymbolTable() {
+  slots.assign(16, -1);
+  mask = 15;
+  intern("");
+}
+
+// Returns the id of the name, adding the name if it's new
+int SymbolTable::intern(const std::string &name) {
+  unsigned int i = slot(name);
+  if(slots[i] >= 0) return slots[i];
+
+  int id = (int)names.size();
+  names.push_back(name);
+  slots[i] = id;
+
+  if(2 * names.size() > slots.size()) {  // keep at most half of the slots used
+    slots.assign(2 * slots.size(), -1);
+    mask = (unsigned int)slots.size() - 1;
+    for(int j = 0; j < (int)names.size(); ++j)
+      slots[slot(names[j])] = j;
+  }
+  return id;
+}
+
+// Returns the id of the name, -1 if it has never been interned
+int SymbolTable::find(const std::string &name) const {
+  return slots[slot(name)];
+}
+
+const std::string & SymbolTable::name(const int id) const {
+  return names[id];
+}
+
+int SymbolTable::size() const {
+  return (int)names.size();
+}
+
+// Returns the slot of the name, or the free slot it would go into. The FNV-1a
+// hash of the name gives the first slot to probe.
+unsigned int SymbolTable::slot(const std::string &name) const {
+  unsigned int h = 2166136261u;
+  for(int i = 0; i < (int)name.size(); ++i) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  h &= mask;
+  while(slots[h] >= 0 && names[slots[h]] != name)
+    h = (h + 1) & mask;
+  return h;
+}
+
+// Index all nodes by name id, remembering their position in the vector
+void NodeIndex::build(std::vector<Node *> &nodes, const int symbols) {
+  first.assign(symbols + 1, 0);
+  for(int i = 0; i < (int)nodes.size(); ++i)
+    ++first[nodes[i]->nameId + 1];
+  for(int i = 0; i < symbols; ++i)
+    first[i+1] += first[i];
+
+  vector<int> next(first.begin(), first.end() - 1);
+  entries.resize(nodes.size());
+  for(int i = 0; i < (int)nodes.size(); ++i) {
+    Entry &e = entries[next[nodes[i]->nameId]++];
+    e.node = nodes[i];
+    e.pos = i;
+  }
+}
+
+// Drop a node from the index, e.g. when it gets erased from the nodes vector
+void NodeIndex::remove(Node * node) {
+  int id = node->nameId;
+  for(int i = first[id]; i < first[id+1]; ++i)
+    if(entries[i].node == node) {
+      entries[i].node = NULL;
+      return;
+    }
+}
+
+// Returns the last indexed node with the given name id, NULL if there is none
+Node * NodeIndex::find(const int id) {
+  if(id < 0 || id + 1 >= (int)first.size()) return NULL;
+  for(int i = first[id+1] - 1; i >= first[id]; --i)
+    if(entries[i].node != NULL) return entries[i].node;
+  return NULL;
+}
+
+// Collects the build positions of all nodes that share the name of the
+// specified node and were indexed after it
+void NodeIndex::laterDuplicates(Node * node, std::vector<int> &positions) {
+  int id = node->nameId;
+  bool after = false;
+  for(int i = first[id]; i < first[id+1]; ++i) {
+    if(after && entries[i].node != NULL) positions.push_back(entries[i].pos);
+    if(entries[i].node == node) after = true;
+  }
+}
+
+// Fills the arrays from the nodes and gives every node its index. Links to
+// nodes which aren't in the vector (any more) count as missing.
+void LayoutCore::build(std::vector<Node *> &nodes, Cladogram * clad) {
+  int count = (int)nodes.size();
+  for(int i = 0; i < count; ++i)
+    nodes[i]->index = i;
+
+  int MinY = clad->monthsInYear;
+  int DinM = clad->daysInMonth;
+
+  // The keys keep the dates as they are, so that they sort like operator<,
+  // even where a day lies beyond daysInMonth. Only the stop plus spacing gets
+  // its overflow resolved, as fitsInto() always did.
+  vector<Date> stopSpaced(count);
+  maxMonth = MinY;
+  maxDay = DinM;
+  for(int i = 0; i < count; ++i) {
+    Node * n = nodes[i];
+    stopSpaced[i] = rOf(n->stop + clad->stopSpacing, MinY, DinM);
+    maxMonth = max(maxMonth, max(n->start.month, n->stop.month));
+    maxDay = max(maxDay, max(n->start.day, n->stop.day));
+  }
+
+  parent.resize(count);
+  startKey.resize(count);
+  stopKey.resize(count);
+  stopSpacedKey.resize(count);
+  startPX.resize(count);
+  stopPX.resize(count);
+  stopSpacedPX.resize(count);
+  for(int i = 0; i < count; ++i) {
+    Node * n = nodes[i];
+    Node * p = n->parent;
+    parent[i] = (p != NULL && p->index >= 0 && p->index < count &&
+                 nodes[p->index] == p) ? (p->index) : (-1);
+
+    startKey[i] = key(n->start);
+    stopKey[i] = key(n->stop);
+    stopSpacedKey[i] = key(stopSpaced[i]);
+    startPX[i] = datePX(n->start, clad);
+    stopPX[i] = datePX(n->stop, clad);
+    stopSpacedPX[i] = datePX(n->stop + clad->stopSpacing, clad);
+  }
+}
+
+// Returns the date packed with the room of the built keys
+int LayoutCore::key(const Date &d) const {
+  return d.serial(maxMonth, maxDay);
+}
+
+bool LaneIndex::Entry::operator<(const Entry &e) const {
+  if(startKey != e.startKey) return startKey < e.startKey;
+  if(stopKey != e.stopKey) return stopKey < e.stopKey;
+  return index < e.index;
+}
+
+// Lanes are numbered in ascending offset order. The offset of a lane is the
+// sum of the weights of all lanes up to it, so inserting or removing an offset
+// below a lane is a single Fenwick update instead of a sweep over all nodes.
+// Lanes moved onto an occupied offset get merged into the lane found there.
+
+LaneIndex::LaneIndex() {
+  core = NULL;
+  used = 0;
+  base = 0;
+}
+
+// Sort all nodes into the lanes given by their current offsets. The dates are
+// taken from the core.
+void LaneIndex::build(std::vector<Node *> &nodes, const LayoutCore &tcore) {
+  core = &tcore;
+  all = nodes;
+  rebuild();
+}
+
+void LaneIndex::clear() {
+  for(int i = 0; i < (int)all.size(); ++i)
+    all[i]->lane = -1;
+  all.clear();
+  sets.clear();
+  rep.clear();
+  weight.clear();
+  fenwick.clear();
+  used = 0;
+}
+
+// Returns the current offset of an indexed node
+int LaneIndex::offset(Node * node) {
+  if(node->lane < 0) return node->offset;  // not indexed
+  return base + prefix(find(node->lane));
+}
+
+// Returns the nodes on the given offset, NULL if there are none
+const LaneIndex::Lane * LaneIndex::lane(const int offset) {
+  int l = laneAt(offset);
+  if(l < 0 || sets[l].size() == 0) return NULL;
+  return &sets[l];
+}
+
+// Returns the first node of the lane starting after the given date
+LaneIndex::Lane::const_iterator LaneIndex::startingAfter(const Lane * lane,
+                                                         const int key) {
+  Entry probe;
+  probe.startKey = key;
+  probe.stopKey = numeric_limits<int>::max();
+  probe.stopSpacedKey = 0;
+  probe.index = numeric_limits<int>::max();
+  probe.node = NULL;
+  return lane->upper_bound(probe);
+}
+
+// Moves a single node to the specified offset
+void LaneIndex::move(Node * node, const int offset) {
+  int l = laneAt(offset);
+  if(l < 0) {
+    int top = base + prefix(used - 1);
+    if(top < offset && used < (int)weight.size()) {  // open a new lane on top
+      l = used++;
+      sets[l].clear();
+      rep[l] = l;
+      weight[l] = 0;
+      addWeight(l, offset - top);
+    } else {  // offset lies in a gap or beyond the table
+      materialize();
+      node->offset = offset;
+      rebuild();
+      return;
+    }
+  }
+  Entry e = entry(node);
+  sets[find(node->lane)].erase(e);
+  sets[l].insert(e);
+  node->lane = l;
+}
+
+// Moves all lanes with an offset higher than the specified one by given value.
+void LaneIndex::shift(const int offset, const int move) {
+  if(move == 0) return;
+
+  int l = lowerBound(offset - base + 1);
+  if(l >= used) return;
+
+  if(prefix(l) == weight[l])  // no lane below, move the whole table
+    base += move;
+  else if(weight[l] + move >= 1)
+    addWeight(l, move);
+  else if(weight[l] + move == 0) {  // merge into the lane below
+    int below = lowerBound(prefix(l) - weight[l]);
+    addWeight(l, move);
+    int a = find(below), b = find(l);
+    if(sets[a].size() < sets[b].size()) sets[a].swap(sets[b]);
+    sets[a].insert(sets[b].begin(), sets[b].end());
+    sets[b].clear();
+    rep[b] = a;
+  } else {  // lanes would pass each other, sweep the offsets instead
+    materialize();
+    for(int i = 0; i < (int)all.size(); ++i)
+      if(all[i]->offset > offset)
+        all[i]->offset += move;
+    rebuild();
+  }
+}
+
+// Writes the current offsets to all indexed nodes
+void LaneIndex::materialize() {
+  materialize(all.begin(), all.end());
+}
+
+// Writes the current offsets to the given nodes
+void LaneIndex::materialize(std::vector<Node *>::iterator first,
+                            std::vector<Node *>::iterator last) {
+  for(std::vector<Node *>::iterator it = first; it != last; ++it)
+    (*it)->offset = offset(*it);
+}
+
+// Builds the lane table from the current node offsets. An empty lane is kept
+// below the lowest one and room is left for lanes opened on top.
+void LaneIndex::rebuild() {
+  vector<int> offsets;
+  for(int i = 0; i < (int)all.size(); ++i)
+    offsets.push_back(all[i]->offset);
+  sort(offsets.begin(), offsets.end());
+  offsets.erase(unique(offsets.begin(), offsets.end()), offsets.end());
+
+  int count = (int)offsets.size() + 1;
+  int size = 16;
+  while(size < 2 * count) size *= 2;
+
+  sets.clear();
+  sets.resize(size);
+  rep.resize(size);
+  weight.assign(size, 0);
+  fenwick.assign(size + 1, 0);
+  used = count;
+
+  base = (offsets.size() > 0) ? (offsets[0] - 2) : (-2);
+  rep[0] = 0;
+  addWeight(0, 1);
+  for(int i = 1; i < count; ++i) {
+    rep[i] = i;
+    addWeight(i, offsets[i-1] - ((i > 1) ? (offsets[i-2]) : (base + 1)));
+  }
+
+  for(int i = 0; i < (int)all.size(); ++i) {
+    int l = 1 + int(lower_bound(offsets.begin(), offsets.end(),
+                                all[i]->offset) - offsets.begin());
+    all[i]->lane = l;
+    sets[l].insert(entry(all[i]));
+  }
+}
+
+// Returns the lane entry of an indexed node
+LaneIndex::Entry LaneIndex::entry(Node * node) {
+  Entry e;
+  e.startKey = core->startKey[node->index];
+  e.stopKey = core->stopKey[node->index];
+  e.stopSpacedKey = core->stopSpacedKey[node->index];
+  e.index = node->index;
+  e.node = node;
+  return e;
+}
+
+// Returns the representative of a (possibly merged) lane
+int LaneIndex::find(int lane) {
+  while(rep[lane] != lane) {
+    rep[lane] = rep[rep[lane]];
+    lane = rep[lane];
+  }
+  return lane;
+}
+
+// Returns the lane on the given offset, -1 if there is none
+int LaneIndex::laneAt(const int offset) {
+  int l = lowerBound(offset - base);
+  if(l >= used || prefix(l) != offset - base) return -1;
+  return l;
+}
+
+// Sum of the weights of all lanes up to and including the given one
+int LaneIndex::prefix(int lane) {
+  int sum = 0;
+  for(int i = lane + 1; i > 0; i -= i & -i)
+    sum += fenwick[i];
+  return sum;
+}
+
+// Returns the first lane with a prefix sum not smaller than the given one,
+// used if there is none
+int LaneIndex::lowerBound(int sum) {
+  if(sum <= 0) return 0;
+  int pos = 0;
+  for(int step = (int)weight.size(); step > 0; step /= 2)
+    if(pos + step <= (int)weight.size() && fenwick[pos + step] < sum) {
+      pos += step;
+      sum -= fenwick[pos];
+    }
+  return (pos < used) ? (pos) : (used);
+}
+
+void LaneIndex::addWeight(int lane, const int delta) {
+  weight[lane] += delta;
+  for(int i = lane + 1; i < (int)fenwick.size(); i += i & -i)
+    fenwick[i] += delta;
+}
+
 Connector::Connector() {
+  fromId = SymbolTable::empty;
+  toId = SymbolTable::empty;
   from = NULL;
   to = NULL;
 }
@@ -314,6 +727,68 @@ InputFile::~InputFile() {
   delete p;
 }
 
+MappedFile::MappedFile(const std::string fname) {
+  data = "";
+  size = 0;
+  map = NULL;
+
+#ifdef GNUCLAD_POSIX
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) throw "failed to open file " + fname;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void * m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m != MAP_FAILED) {
+      map = m;
+      data = (const char *)m;
+      size = st.st_size;
+      madvise(m, size, MADV_SEQUENTIAL);
+    }
+  }
+  close(fd);
+  if(map != NULL) return;
+#endif
+
+  // Read it instead
+  std::ifstream * fp = new_infile(fname);
+  char chunk[65536];
+  while(fp->read(chunk, sizeof(chunk)) || fp->gcount() > 0)
+    buffer.insert(buffer.end(), chunk, chunk + fp->gcount());
+  safeClose(fp);
+  delete fp;
+  if(buffer.size() > 0) {
+    data = &buffer[0];
+    size = buffer.size();
+  }
+}
+MappedFile::~MappedFile() {
+#ifdef GNUCLAD_POSIX
+  if(map != NULL) munmap(map, size);
+#endif
+}
+
+StringSlice::StringSlice() {
+  data = "";
+  size = 0;
+}
+StringSlice::StringSlice(const char * tdata, const int tsize) {
+  data = tdata;
+  size = tsize;
+}
+StringSlice::StringSlice(const std::string &str) {
+  data = str.data();
+  size = (int)str.size();
+}
+std::string StringSlice::str() const {
+  return std::string(data, size);
+}
+bool StringSlice::operator==(const char * s) const {
+  return (int)strlen(s) == size && strncmp(data, s, size) == 0;
+}
+bool StringSlice::operator!=(const char * s) const {
+  return !(*this == s);
+}
+
 OutputFile::OutputFile(std::string tname) {
   name = tname;
   p = new_outfile(name);
@@ -332,3 +807,4 @@ OutputFile::~OutputFile() {
 
 Parser::~Parser() {}
 Generator::~Generator() {}
+void Generator::keepParsedData(Cladogram *) {}
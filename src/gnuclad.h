@@ -26,9 +26,12 @@
 //~ #include <string>
 //~ #include <exception>
 #include <vector>
+#include <algorithm>
+#include <cstddef>
 #include <fstream>
 #include <sstream>
-#include <deque>
+#include <map>
+#include <set>
 
 #include "gnuclad-portability.h"
 
@@ -65,9 +68,10 @@ class Date {
   Date(int tyear, int tmonth);
   Date(int tyear);
   Date(const std::string str);
-  bool operator<(const Date d);
-  bool operator==(Date d);
+  bool operator<(const Date d) const;
+  bool operator==(Date d) const;
   Date operator+(const Date d);
+  int serial(int maxMonth, int maxDay) const;
 };
 
 class Image {
@@ -101,11 +105,21 @@ class Node {
   std::string iconfile;
   std::string description;
 
+  int nameId;    // SymbolTable ids of name and parentName, set by
+  int parentId;  // Cladogram::compute()
+
   Node * parent;
   std::vector<Node *> children;
+  Node * rootNode;  // cached by Cladogram::compute()
+  int depth;
+  int eulerIn;
+  int eulerOut;
 
   int size;
+  double lineGrowth;  // (sqrt(size) - 1) * bigParent
+  int index;          // into the LayoutCore arrays
   int offset;
+  int lane;
 
   Node();
   void addNameChange(std::string newName, Date date, std::string description);
@@ -113,9 +127,162 @@ class Node {
   bool derivesFrom(Node * p);
 };
 
+// Every distinct name stored once and referred to by an id, in the order the
+// names were first seen. The empty name always has the id 0.
+class SymbolTable {
+  public:
+  static const int empty = 0;
+
+  SymbolTable();
+  int intern(const std::string &name);
+  int find(const std::string &name) const;
+  const std::string & name(const int id) const;
+  int size() const;
+
+  private:
+  std::vector<std::string> names;
+  std::vector<int> slots;  // ids by hash, open addressing, -1 = free
+  unsigned int mask;
+
+  unsigned int slot(const std::string &name) const;
+};
+
+class NodeIndex {
+  public:
+
+  void build(std::vector<Node *> &nodes, const int symbols);
+  void remove(Node * node);
+  Node * find(const int id);
+  void laterDuplicates(Node * node, std::vector<int> &positions);
+
+  private:
+  struct Entry {
+    Node * node;  // NULL once removed
+    int pos;
+  };
+  std::vector<Entry> entries;  // grouped by name id, in build order
+  std::vector<int> first;      // entries of id i: first[i] to first[i+1] - 1
+};
+
+class Cladogram;
+
+// The date keys and pixel positions of the nodes, as flat arrays indexed by
+// Node::index, for the date comparisons of the lane searches and overlap
+// checks. Built by Cladogram::compute(). The tree links, children order and
+// offsets are not in here, the layout passes keep those on the Node objects.
+class LayoutCore {
+  public:
+  std::vector<int> parent;         // index of the parent, -1 for roots
+  std::vector<int> startKey;       // key() of start, stop and
+  std::vector<int> stopKey;        // rOf(stop + stopSpacing)
+  std::vector<int> stopSpacedKey;
+  std::vector<int> startPX;        // datePX() of start, stop and
+  std::vector<int> stopPX;         // stop + stopSpacing
+  std::vector<int> stopSpacedPX;
+
+  int maxMonth;  // room left in the keys, at least the largest month and
+  int maxDay;    // day of any date given to build()
+
+  void build(std::vector<Node *> &nodes, Cladogram * clad);
+  int key(const Date &d) const;
+};
+
+class LaneIndex {
+  public:
+
+  // A node in a lane, with the dates the lane is searched by
+  struct Entry {
+    int startKey;
+    int stopKey;
+    int stopSpacedKey;
+    int index;  // Node::index, for a deterministic order of equal dates
+    Node * node;
+
+    // Orders by start date, ties by stop date and then by index
+    bool operator<(const Entry &e) const;
+  };
+  typedef std::set<Entry> Lane;
+
+  LaneIndex();
+  void build(std::vector<Node *> &nodes, const LayoutCore &tcore);
+  void clear();
+  int offset(Node * node);
+  const Lane * lane(const int offset);
+  Lane::const_iterator startingAfter(const Lane * lane, const int key);
+  void move(Node * node, const int offset);
+  void shift(const int offset, const int move);
+  void materialize();
+  void materialize(std::vector<Node *>::iterator first,
+                   std::vector<Node *>::iterator last);
+
+  private:
+  const LayoutCore * core;
+  std::vector<Node *> all;
+  std::vector<Lane> sets;     // nodes per lane, valid on merge representatives
+  std::vector<int> rep;       // merge representative (union-find)
+  std::vector<int> weight;    // distance to the offset of the previous lane
+  std::vector<int> fenwick;   // prefix sums over weight
+  int used;
+  int base;
+
+  Entry entry(Node * node);
+  void rebuild();
+  int find(int lane);
+  int laneAt(const int offset);
+  int prefix(int lane);
+  int lowerBound(int sum);
+  void addWeight(int lane, const int delta);
+};
+
+// The lanes and the offset ordered nodes a layout pass works on, either the
+// whole map or a single root tree in its own offsets. A local layout does not
+// know the lanes outside of its tree, so moving a node there marks it escaped.
+class Layout {
+  public:
+  bool escaped;
+  int end;  // offset the next tree starts at, in a local layout
+
+  Layout(Cladogram * tclad, LaneIndex &tlanes, std::vector<Node *> &tnodes,
+         bool tlocal);
+  bool fitsInto(const int offset, Node * node);
+  bool fitsInto(const int offset, const int startKey, const int stopSpacedKey);
+  void moveOffsetsHigherThan(const int offset, const int move);
+
+  void optimise_nextTree(int first, int last);
+  void optimise_pullToRoot(int first, int last, bool stronger);
+  void optimise_pullToParent(Node * root, int first, int last);
+  bool optimise_strictOverlaps(Node * n, int oldOffset, int sign,
+                               int first, int last);
+
+  private:
+  Cladogram * clad;
+  LaneIndex &lanes;
+  std::vector<Node *> &nodes;
+  bool local;
+  std::vector<int> overlapping;  // reused by optimise_strictOverlaps()
+  int timeStartKey;    // keys of a node spanning the whole time frame
+  int timeStopKey;
+
+  void move(Node * node, const int offset);
+};
+
+// The layout of a single root tree in its own offsets, as kept in the layout
+// cache. Nodes are referred to by their position in the tree before the layout.
+class TreeSnapshot {
+  public:
+  int span;
+  bool escaped;
+  std::vector<int> order;     // positions, in the order after the layout
+  std::vector<int> offsets;   // offsets, in the order after the layout
+  std::vector< std::vector<int> > children;  // children of every position
+
+  TreeSnapshot();
+};
+
 class Domain {
   public:
   std::string nodeName;
+  int nodeId;  // SymbolTable id of nodeName, set by Cladogram::compute()
   Color color;
   int intensity;
 
@@ -130,6 +297,8 @@ class Connector {
   public:
   std::string fromName;
   std::string toName;
+  int fromId;  // SymbolTable ids of fromName and toName, set by
+  int toId;    // Cladogram::compute()
   Date fromWhen;
   Date toWhen;
   int thickness;
@@ -162,6 +331,38 @@ class OutputFile {
   ~OutputFile();
 };
 
+// The whole content of a file, mapped into memory if the system allows it and
+// read into a buffer otherwise
+class MappedFile {
+  public:
+  const char * data;
+  std::size_t size;
+
+  MappedFile(const std::string fname);
+  ~MappedFile();
+
+  private:
+  void * map;
+  std::vector<char> buffer;
+
+  MappedFile(const MappedFile &);
+  MappedFile & operator=(const MappedFile &);
+};
+
+// A string within a larger buffer, which is only copied on request
+class StringSlice {
+  public:
+  const char * data;
+  int size;
+
+  StringSlice();
+  StringSlice(const char * tdata, const int tsize);
+  StringSlice(const std::string &str);
+  std::string str() const;
+  bool operator==(const char * s) const;
+  bool operator!=(const char * s) const;
+};
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -169,25 +370,85 @@ class OutputFile {
 // Cladogram Class
 //
 
+// Hands out default constructed objects from blocks of growing size. They are
+// never released one by one, only all at once when the pool goes.
+template<class T>
+class Pool {
+  public:
+  Pool() : used(0), size(0) {}
+  ~Pool() {
+    for(int i = 0; i < (int)blocks.size(); ++i)
+      delete[] blocks[i];
+  }
+
+  T * allocate() {
+    if(used == size) {
+      size = (size == 0) ? (64) : (std::min(size * 2, 4096));
+      blocks.push_back(new T[size]);
+      used = 0;
+    }
+    return &blocks.back()[used++];
+  }
+
+  // Takes over the objects handed out by another pool, which is left empty
+  void take(Pool &other) {
+    if(blocks.size() == 0) {
+      blocks.swap(other.blocks);
+      used = other.used;
+      size = other.size;
+    } else  // keep handing out from the own last block
+      blocks.insert(blocks.end() - 1, other.blocks.begin(), other.blocks.end());
+    other.blocks.clear();
+    other.used = 0;
+    other.size = 0;
+  }
+
+  private:
+  std::vector<T *> blocks;
+  int used;  // objects handed out from the last block
+  int size;  // of the last block
+
+  Pool(const Pool &);
+  Pool & operator=(const Pool &);
+};
+
 class Cladogram {
 
   private:
   void debug_cladogram_compute();
+  void compute_tree();
+  void compute_subtreeAggregates();
+  std::vector<Node *> tour;  // nodes reachable from a root, in preorder
 
-  void compute_subtreeBoth(std::deque<Node *> &tree, int pos, Node * n);
-  void compute_subtreeLower(std::deque<Node *> &tree, int pos, Node * n);
-  void compute_subtreeLowerInverse(std::deque<Node *> &tree, int pos, Node * n);
+  LaneIndex lanes;
+
+  Pool<Node> nodePool;  // the objects behind the vectors below
+  Pool<Domain> domainPool;
+  Pool<Connector> connectorPool;
+  Pool<Image> imagePool;
+
+  void compute_subtreeBoth(std::vector< std::pair<Node *, bool> > &todo,
+                           Node * n);
+  void compute_subtreeLower(std::vector< std::pair<Node *, bool> > &todo,
+                            Node * n);
+  void compute_subtreeLowerInverse(std::vector< std::pair<Node *,bool> > &todo,
+                                   Node * n);
 
-  bool fitsInto(const int offset, Node * node);
-  void moveOffsetsHigherThan(const int offset, const int move);
   void moveTo(int offset, Node * node, std::vector<Node *> &v);
 
-  void optimise_injectSingleRootAt(int i, int upTo);
-  void optimise_nextTree(int first, int last);
-  void optimise_pullToRoot(int first, int last, bool stronger);
-  void optimise_pullToParent(Node * root, int first, int last);
-  bool optimise_strictOverlaps(Node * n, int oldOffset, int sign,
-                               int first, int last);
+  void optimise_injectSingleRootAt(Layout &map, int i, int upTo);
+  void optimise_packSingleRoots();
+  void optimise_trees(std::set<Node *> &laidOut);
+
+  std::map<std::string, TreeSnapshot> treeSnapshots;  // by tree key
+  std::string layoutCache_treeKey(std::vector<Node *> &tree);
+  std::string layoutCache_key(std::vector<Node *> &order);
+  bool layoutCache_load(const std::string key, std::vector<Node *> &order);
+  void layoutCache_store(const std::string key, std::vector<Node *> &order);
+
+  double optimiseDeadline;  // wall clock ms at which optimiseBudgetMs runs out
+  int passesDone;
+  int passesTotal;
 
   public:
   std::vector<Node *> nodes;
@@ -235,8 +496,11 @@ class Cladogram {
   int sortKey;
   int optimise;
   bool strictOverlaps;
+  bool packSingleRoots;  // pack single roots instead of injecting them
   int treeSpacing;
   int treeSpacingBiggerThan;
+  std::string layoutCache;  // file to reuse the layout from, "" = disabled
+  int optimiseBudgetMs;  // time limit of the optimisation, 0 = unlimited
 
   Color mainBackground;
   int rulerWidth;
@@ -290,6 +554,11 @@ class Cladogram {
 
   // CONFIG OPTIONS END
 
+  int jobs;  // threads reading CSV and laying out root trees, set by --jobs
+
+  LayoutCore core;  // built by compute()
+  SymbolTable symbols;  // all node names, filled by compute()
+
 
   Cladogram();
   ~Cladogram();
@@ -301,6 +570,7 @@ class Cladogram {
   Domain * addDomain(std::string tname);
   Connector * addConnector();
   Image * addImage(std::string tname, std::vector<Image *> &vector);
+  void takeRecords(Cladogram &other);
 
   void nodesPreorder();
 
@@ -322,11 +592,44 @@ class Parser {
 class Generator {
   public:
   virtual ~Generator();
+  // Called with the data as parsed, before Cladogram::compute() changes it
+  virtual void keepParsedData(Cladogram * cladogram);
   virtual void writeData(Cladogram * cladogram, OutputFile & out) = 0;
 };
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+///
+// Binary Dataset Format (.gcb), see ParserGCB and GeneratorGCB
+//
+
+// Every field is a 32 bit little endian integer, strings are ids into the
+// string table and dates and colors are packed by packDate() and packColor().
+//   header:      magic, version, string count, string bytes, then the counts
+//                of nodes, name changes, connectors, domains, SVG and PNG
+//                images
+//   strings:     string count + 1 offsets into the string bytes, then the
+//                bytes, padded to a multiple of 4
+//   node:        name, parent, color, start, stop, icon, description,
+//                first name change, name change count
+//   name change: new name, date, description
+//   connector:   from when, from, to when, to, thickness, color
+//   domain:      node, color, intensity
+//   image:       file name, x, y
+enum {
+  gcbMagic = 0x31424347,  // "GCB1"
+  gcbVersion = 1,
+  gcbHeaderFields = 10,
+  gcbNodeFields = 9,
+  gcbNameChangeFields = 3,
+  gcbConnectorFields = 6,
+  gcbDomainFields = 3,
+  gcbImageFields = 3
+};
+
+
+
 ////////////////////////////////////////////////////////////////////////////////
 ///
 // Helper Function Definitions
@@ -343,20 +646,34 @@ void safeClose(std::ifstream * fp);
 void safeClose(std::ofstream * fp);
 void explode(const std::string str, const char delimiter,
              std::vector<std::string> * v);
+void explodeSafely(const char * str, const int len, const char delimiter,
+                   const char toggle, std::vector<StringSlice> * v);
 void explodeSafely(const std::string str, const char delimiter,
                    const char toggle, std::vector<std::string> * v);
 std::string findReplace(std::string str, std::string find, std::string replace);
+bool parseInt(const StringSlice s, int * n);
+bool parseDouble(const StringSlice s, double * d);
+bool parseDate(const StringSlice s, Date * d);
+bool parseColor(const StringSlice s, Color * c);
 double str2double(const std::string str);
 int str2int(const std::string s);
+double wallClockMs();
 std::string int2str(const int n);
 std::string base64_encode(const char * raw, unsigned int len);
 Date currentDate();
 std::string Date2str(Date date);
 int datePX(Date d, Cladogram * clad);
 Date rOf(Date d, int monthsInYear, int daysInMonth);
+void radixSort(std::vector< std::pair<int, Node *> > &items);
 std::string checkHexCol(const std::string color);
 std::string rgb2hexHue(int hue);
 int hex2rgbHue(std::string hhue);
+int packDate(const Date d);
+Date unpackDate(const int n);
+int packColor(const Color c);
+Color unpackColor(const int n);
+void putInt32(std::vector<char> &buf, const int n);
+int getInt32(const char * p);
 
 
 
@@ -365,29 +682,6 @@ int hex2rgbHue(std::string hhue);
 // Sort Comparison Functors
 //
 
-struct compareDate : public std::binary_function<Node *,Node *,bool> {
-  // Returns true if n1 starts before n2, otherwise false
-
-	inline bool operator()(const Node * n1, const Node * n2) {
-		if(n1->start.year < n2->start.year)
-      return true;
-    if(n1->start.year == n2->start.year && n1->start.month < n2->start.month)
-      return true;
-    if(n1->start.year == n2->start.year && n1->start.month == n2->start.month &&
-       n1->start.day < n2->start.day)
-      return true;
-    return false;
-	}
-};
-struct compareOffset : public std::binary_function<Node *,Node *,bool> {
-  // Returns true if n1 has a lower offset than n2, otherwise false
-
-	inline bool operator()(const Node * n1, const Node * n2) {
-		if(n1->offset < n2->offset)
-      return true;
-    return false;
-	}
-};
 struct compareName : public std::binary_function<Node *,Node *,bool> {
   // Returns true if n1 has a lower lexicographic name than n2, otherwise false
 
@@ -397,38 +691,61 @@ struct compareName : public std::binary_function<Node *,Node *,bool> {
     return false;
 	}
 };
-struct compareParDist : public std::binary_function<Node *,Node *,bool> {
-  // Returns true if n1 has a lower offset distance to parent than n2, otherwise
-  // false
 
-	inline bool operator()(const Node * n1, const Node * n2) {
-    if(n1->parent == NULL) return true;
-    if(n2->parent == NULL) return false;
-    int offset1 = n1->offset - n1->parent->offset;
-    if(offset1 < 0) offset1 = -offset1;
-    int offset2 = n2->offset - n2->parent->offset;
-    if(offset2 < 0) offset2 = -offset2;
-		if(offset1 < offset2)
-      return true;
-    return false;
-	}
+
+////////////////////////////////////////////////////////////////////////////////
+///
+// Sort Key Functors, for sortByKey()
+//
+
+struct keyDate {
+  // Returns the start of the node, taken from the LayoutCore. The keys keep
+  // the raw dates, so this sorts like comparing the start dates.
+
+  const LayoutCore * core;
+  keyDate(const LayoutCore &tcore) : core(&tcore) {}
+  inline int operator()(const Node * n) const {
+    return core->startKey[n->index];
+  }
 };
-struct compareRootDist : public std::binary_function<Node *,Node *,bool> {
-  // Returns true if n1 has a lower offset distance to root than n2, otherwise
-  // false
-
-	inline bool operator()(Node * n1, Node * n2) {
-    if(n1->parent == NULL) return true;
-    if(n2->parent == NULL) return false;
-    int offset1 = n1->offset - n1->root()->offset;
-    if(offset1 < 0) offset1 = -offset1;
-    int offset2 = n2->offset - n2->root()->offset;
-    if(offset2 < 0) offset2 = -offset2;
-		if(offset1 < offset2)
-      return true;
-    return false;
-	}
+struct keyOffset {
+  // Returns the offset of the node
+
+  inline int operator()(const Node * n) const {
+    return n->offset;
+  }
+};
+struct keyParDist {
+  // Returns the offset distance of the node to its parent, -1 for roots
+
+  inline int operator()(const Node * n) const {
+    if(n->parent == NULL) return -1;
+    int offset = n->offset - n->parent->offset;
+    return (offset < 0) ? (-offset) : (offset);
+  }
+};
+struct keyRootDist {
+  // Returns the offset distance of the node to its root, -1 for roots
+
+  inline int operator()(const Node * n) const {
+    if(n->parent == NULL) return -1;
+    int offset = n->offset - n->rootNode->offset;
+    return (offset < 0) ? (-offset) : (offset);
+  }
 };
 
+// Sorts the nodes by ascending key, keeping the order of nodes with equal keys.
+// The key of every node is taken once, the sorting is done by radixSort().
+template<class Key>
+void sortByKey(std::vector<Node *>::iterator first,
+               std::vector<Node *>::iterator last, Key key) {
+  std::vector< std::pair<int, Node *> > items;
+  items.reserve(last - first);
+  for(std::vector<Node *>::iterator it = first; it != last; ++it)
+    items.push_back(std::make_pair(key(*it), *it));
+  radixSort(items);
+  for(int i = 0; i < (int)items.size(); ++i)
+    first[i] = items[i].second;
+}
 
 #endif
@@ -19,115 +19,241 @@
 
 #include "csv.h"
 
+#include <cstring>
+
+#ifdef GNUCLAD_POSIX
+#include <pthread.h>
+#endif
+
 using namespace std;
 
 
 ParserCSV::ParserCSV() {}
 ParserCSV::~ParserCSV() {}
 
-void ParserCSV::parseData(Cladogram * clad, InputFile & in) {
 
-  ifstream & f = *(in.p);
+// A run of whole lines of the input and the cladogram its records go to. The
+// first chunk goes straight to the parsed cladogram, the others get their own
+// and are handed over in file order afterwards.
+struct CSVChunk {
+  const char * begin;
+  const char * end;
+  Cladogram * clad;
+
+  int lines;      // number of lines in the chunk
+  int errorLine;  // first invalid line within the chunk, counted from 1
+  string error;
+  char badKind;     // 'i'nt, 'd'ate or 'c'olor field which failed, or 0
+  string badField;
+
+  CSVChunk() : begin(NULL), end(NULL), clad(NULL), lines(0), errorLine(0),
+               badKind(0) {}
+};
+
+// Parse a field, remembering it in the chunk if it's invalid. Worker threads
+// mustn't print, so the error message is left to reportField().
+static bool readField(CSVChunk &chunk, const StringSlice s, int * n) {
+  if(parseInt(s, n)) return true;
+  chunk.badKind = 'i';
+  chunk.badField = s.str();
+  return false;
+}
+static bool readField(CSVChunk &chunk, const StringSlice s, Date * d) {
+  if(parseDate(s, d)) return true;
+  chunk.badKind = 'd';
+  chunk.badField = s.str();
+  return false;
+}
+static bool readField(CSVChunk &chunk, const StringSlice s, Color * c) {
+  if(parseColor(s, c)) return true;
+  chunk.badKind = 'c';
+  chunk.badField = s.str();
+  return false;
+}
+
+// Print the message the conversion of the invalid field gives
+static void reportField(const CSVChunk &chunk) {
+  try {
+    if     (chunk.badKind == 'i') str2int(chunk.badField);
+    else if(chunk.badKind == 'd') Date d(chunk.badField);
+    else if(chunk.badKind == 'c') Color c(chunk.badField);
+  } catch (...) {}
+}
+
+// Parse one line into the cladogram of chunk. Returns false for an invalid
+// entry, which is described in chunk.error.
+static bool parseLine(CSVChunk &chunk, const char * line, const int len,
+                      vector<StringSlice> &entry) {
 
-  string line;
-  int count = 1;
   int fixedFieldsNode = 8;
   int fixedFieldsConnector = 7;
   int fixedFieldsDomain = 4;
   int fixedFieldsImage = 4;
 
-  while( !f.eof() && f.good() ) {
+  entry.clear();
+  //~ explode(line, '\t', &entry);
+  explodeSafely(line, len, ',', '"', &entry);
 
-    getline(f, line);
-    ++count;
+  // remove double quotes
+  for(int i = 0; i < (int)entry.size(); ++i) {
+    StringSlice * e = &entry[i];
+    if(e->size == 0) continue;
+    if(e->data[0] == '"') { ++e->data; --e->size; }
+    if(e->size > 0 && e->data[e->size - 1] == '"') --e->size;
+  }
 
+  if(entry.size() == 0) return true;
+
+  Cladogram * clad = chunk.clad;
+  StringSlice ctl = entry[0];
+  int fields = (int)entry.size();
+  bool valid = true;
+
+  if(ctl.size == 0 || ctl.data[0] == '#' ||
+     (ctl.size >= 2 && ctl.data[0] == '/' && ctl.data[1] == '/')) {}
+  else if(ctl == "N" && fields >= fixedFieldsNode) {  // add a node
+
+    Node * node = clad->addNode(entry[1].str());
+    valid = readField(chunk, entry[2], &node->color) &&
+            readField(chunk, entry[4], &node->start) &&
+            readField(chunk, entry[5], &node->stop);
+    node->parentName = entry[3].str();
+    node->iconfile = entry[6].str();
+    node->description = entry[7].str();
+
+    // get the name changes
+    for(int i = fixedFieldsNode; valid && i < fields-1; i += 3)
+      if(entry[i].size != 0 && entry[i+1].size != 0) {
+        Date date;
+        valid = readField(chunk, entry[i+1], &date);
+        if(valid)
+          node->addNameChange(entry[i].str(), date,
+            (i+2 < fields) ? (entry[i+2].str()) : (""));
+      }
+
+  } else if(ctl == "C" && fields >= fixedFieldsConnector) {  // add a connector
+
+    Connector * c = clad->addConnector();
+    valid = readField(chunk, entry[1], &c->fromWhen);
+    if(entry[3].size == 0) c->toWhen = c->fromWhen;
+    else valid = valid && readField(chunk, entry[3], &c->toWhen);
+    valid = valid && readField(chunk, entry[5], &c->thickness) &&
+            readField(chunk, entry[6], &c->color);
+    c->fromName = entry[2].str();
+    c->toName = entry[4].str();
+
+  } else if(ctl == "D" && fields >= fixedFieldsDomain) {  // add a domain
+
+    Domain * domain = clad->addDomain(entry[1].str());
+    valid = readField(chunk, entry[2], &domain->color) &&
+            readField(chunk, entry[3], &domain->intensity);
+
+  } else if((ctl == "SVG" || ctl == "PNG") && fields >= fixedFieldsImage) {
+
+    Image * image = clad->addImage(entry[1].str(), (ctl == "SVG") ?
+                                   (clad->includeSVG) : (clad->includePNG));
+    valid = readField(chunk, entry[2], &image->x) &&
+            readField(chunk, entry[3], &image->y);
+
+  } else valid = false;
+
+  if(!valid) {
+    if     (ctl == "N") chunk.error = "node ";
+    else if(ctl == "C") chunk.error = "connector at ";
+    else if(ctl == "D") chunk.error = "domain of ";
+    else if(ctl == "SVG") chunk.error = "SVG include ";
+    else                chunk.error = ctl.str();
+    if(fields > 1) chunk.error += entry[1].str();
+  }
+  return valid;
 
-    vector<string> entry;
-    //~ explode(line, '\t', &entry);
-    explodeSafely(line, ',', '"', &entry);
+}
 
-    // remove double quotes
-    for(int i = 0; i < (int)entry.size(); ++i) {
-      string * e = &entry[i];
-      if(e->size() == 0) continue;
-      if(e->at(0) == '"') *e = e->substr(1, e->size() - 1);
-      if(e->at(e->size() - 1) == '"') *e = e->substr(0, e->size() - 1);
+// Parse all lines of a chunk, stopping at the first invalid one
+static void parseChunk(CSVChunk &chunk) {
+  vector<StringSlice> entry;
+  const char * pos = chunk.begin;
+  while(pos < chunk.end) {
+    const char * eol = (const char *)memchr(pos, '\n', chunk.end - pos);
+    if(eol == NULL) eol = chunk.end;
+    ++chunk.lines;
+    if(!parseLine(chunk, pos, int(eol - pos), entry)) {
+      chunk.errorLine = chunk.lines;
+      return;
     }
+    pos = eol + 1;
+  }
+}
 
-    if(entry.size() == 0) continue;
-
-    string what;
-    string ctl = entry[0];
-    if     (ctl == "N") what = "node ";
-    else if(ctl == "C") what = "connector at ";
-    else if(ctl == "D") what = "domain of ";
-    else if(ctl == "SVG") what = "SVG include ";
-    else                what = ctl;
-
-    try {
-
-      if(ctl == "" || ctl[0] == '#' || ctl.substr(0,2) == "//") {}
-      else if(ctl == "N") {  // add a node
-
-        if((int)entry.size() < fixedFieldsNode) throw 0;
-
-        Node * node = clad->addNode(entry[1]);
-        node->color = Color(entry[2]);
-        node->parentName = entry[3];
-        node->start = Date(entry[4]);
-        node->stop = Date(entry[5]);
-        node->iconfile = entry[6];
-        node->description = entry[7];
-
-        // get the name changes
-        for(int i = fixedFieldsNode; i < (int)entry.size()-1; i += 3)
-          if(entry[i] != "" && entry[i+1] != "")
-            node->addNameChange(entry[i], Date(entry[i+1]),entry[i+2]);
-
-      } else if(ctl == "C") {  // add a connector
-
-        if((int)entry.size() < fixedFieldsConnector) throw 0;
-
-        Connector * c = clad->addConnector();
-        c->fromWhen = Date(entry[1]);
-        c->fromName = entry[2];
-        if(entry[3] == "") c->toWhen = c->fromWhen;
-        else c->toWhen = Date(entry[3]);
-        c->toName = entry[4];
-        c->thickness = str2int(entry[5]);
-        c->color = Color(entry[6]);
-
-      } else if(ctl == "D") {  // add a domain
-
-        if((int)entry.size() < fixedFieldsDomain) throw 0;
-
-        Domain * domain = clad->addDomain(entry[1]);
-        domain->color = Color(entry[2]);
-        domain->intensity = str2int(entry[3]);
-
-      } else if(ctl == "SVG") {
-
-        if((int)entry.size() < fixedFieldsImage) throw 0;
-
-        Image * image = clad->addImage(entry[1], clad->includeSVG);
-        image->x = str2int(entry[2]);
-        image->y = str2int(entry[3]);
-
-      } else if(ctl == "PNG") {
-
-        if((int)entry.size() < fixedFieldsImage) throw 0;
-
-        Image * image = clad->addImage(entry[1], clad->includePNG);
-        image->x = str2int(entry[2]);
-        image->y = str2int(entry[3]);
+#ifdef GNUCLAD_POSIX
+static void * parseChunkWorker(void * arg) {
+  parseChunk(*(CSVChunk *)arg);
+  return NULL;
+}
+#endif
 
-      } else throw 0;
+void ParserCSV::parseData(Cladogram * clad, InputFile & in) {
 
-    } catch (...) {
-      throw "invalid entry at line " + int2str(count - 1)
-            + " (" + what + entry[1] + ")";
+  // Lines and fields are slices of the mapped file, strings only get made
+  // for the values which are kept
+  MappedFile file(in.name);
+
+  // Big inputs are cut at line ends into one chunk per job, small ones
+  // aren't worth a thread
+  const size_t minChunkSize = 1 << 18;
+  int chunkCount = 1;
+  if(clad->jobs > 1)
+    chunkCount = (int)std::min((size_t)clad->jobs,
+                               std::max((size_t)1, file.size / minChunkSize));
+
+  vector<CSVChunk> chunks(chunkCount);
+  chunks[0].clad = clad;
+  for(int i = 1; i < chunkCount; ++i)
+    chunks[i].clad = new Cladogram;
+  const char * pos = file.data;
+  const char * end = file.data + file.size;
+  for(int i = 0; i < chunkCount; ++i) {
+    chunks[i].begin = pos;
+    if(i == chunkCount - 1) pos = end;
+    else {
+      pos = std::max(pos, file.data + file.size / chunkCount * (i + 1));
+      const char * eol = (const char *)memchr(pos, '\n', end - pos);
+      pos = (eol == NULL) ? (end) : (eol + 1);
     }
+    chunks[i].end = pos;
+  }
 
+  int started = 0;
+#ifdef GNUCLAD_POSIX
+  vector<pthread_t> pool(chunkCount - 1);
+  for(; started < chunkCount - 1; ++started)
+    if(pthread_create(&pool[started], NULL, parseChunkWorker,
+                      &chunks[started + 1]) != 0)
+      break;
+#endif
+  parseChunk(chunks[0]);  // this thread takes the first chunk
+  for(int i = started + 1; i < chunkCount; ++i)
+    parseChunk(chunks[i]);
+#ifdef GNUCLAD_POSIX
+  for(int i = 0; i < started; ++i)
+    pthread_join(pool[i], NULL);
+#endif
+
+  // Merge in file order, which is the order sortKey 0 keeps
+  string error = "";
+  int line = 0;
+  for(int i = 0; i < chunkCount; ++i) {
+    CSVChunk &chunk = chunks[i];
+    if(error == "" && chunk.errorLine != 0) {
+      reportField(chunk);
+      error = "invalid entry at line " + int2str(line + chunk.errorLine)
+              + " (" + chunk.error + ")";
+    }
+    line += chunk.lines;
+    if(i == 0) continue;
+    if(error == "") clad->takeRecords(*chunk.clad);
+    delete chunk.clad;
   }
+  if(error != "") throw error;
 
 }
@@ -0,0 +1,162 @@
+/*
+*  gcb.cpp - implements a binary dataset parser for gnuclad
+*
+*  Copyright (C) 2010-2011 Donjan Rodic <donjan@dyx.ch>
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gcb.h"
+
+using namespace std;
+
+
+ParserGCB::ParserGCB() {}
+ParserGCB::~ParserGCB() {}
+
+
+// The sections of a mapped .gcb file, see gnuclad.h for the layout
+struct GCBFile {
+  const char * data;
+  int strings;
+  const char * offsets;
+  const char * bytes;
+  int byteCount;
+
+  // Returns string id, which has been checked against the table
+  string str(const int id) const {
+    int begin = getInt32(offsets + 4 * id);
+    return string(bytes + begin, getInt32(offsets + 4 * (id + 1)) - begin);
+  }
+};
+
+// Returns field i of the record at p, throwing if it isn't a valid string id
+static int stringId(const GCBFile &gcb, const char * p, const int i) {
+  int id = getInt32(p + 4 * i);
+  if(id < 0 || id >= gcb.strings) throw 0;
+  return id;
+}
+
+void ParserGCB::parseData(Cladogram * clad, InputFile & in) {
+
+  MappedFile file(in.name);
+
+  try {
+
+    // Check the header and that all sections fit into the file
+    if(file.size < 4 * gcbHeaderFields) throw 0;
+    const char * h = file.data;
+    if(getInt32(h) != gcbMagic || getInt32(h + 4) != gcbVersion) throw 0;
+
+    GCBFile gcb;
+    gcb.data = file.data;
+    gcb.strings = getInt32(h + 8);
+    gcb.byteCount = getInt32(h + 12);
+    int nodeCount = getInt32(h + 16);
+    int nameChangeCount = getInt32(h + 20);
+    int connectorCount = getInt32(h + 24);
+    int domainCount = getInt32(h + 28);
+    int svgCount = getInt32(h + 32);
+    int pngCount = getInt32(h + 36);
+
+    const int counts[] = { gcb.strings, gcb.byteCount, nodeCount,
+      nameChangeCount, connectorCount, domainCount, svgCount, pngCount };
+    for(int i = 0; i < 8; ++i)
+      if(counts[i] < 0 || counts[i] > (int)file.size) throw 0;
+    if(gcb.strings < 1) throw 0;
+
+    size_t size = 4 * gcbHeaderFields;
+    gcb.offsets = file.data + size;
+    size += 4 * ((size_t)gcb.strings + 1);
+    gcb.bytes = file.data + size;
+    size += ((size_t)gcb.byteCount + 3) / 4 * 4;
+    const char * nodes = file.data + size;
+    size += 4 * gcbNodeFields * (size_t)nodeCount;
+    const char * nameChanges = file.data + size;
+    size += 4 * gcbNameChangeFields * (size_t)nameChangeCount;
+    const char * connectors = file.data + size;
+    size += 4 * gcbConnectorFields * (size_t)connectorCount;
+    const char * domains = file.data + size;
+    size += 4 * gcbDomainFields * (size_t)domainCount;
+    const char * images = file.data + size;
+    size += 4 * gcbImageFields * ((size_t)svgCount + pngCount);
+    if(size != file.size) throw 0;
+
+    for(int i = 0; i < gcb.strings; ++i) {
+      int begin = getInt32(gcb.offsets + 4 * i);
+      int end = getInt32(gcb.offsets + 4 * (i + 1));
+      if(begin < 0 || begin > end || end > gcb.byteCount) throw 0;
+    }
+
+
+    // Nodes
+    for(int i = 0; i < nodeCount; ++i) {
+      const char * p = nodes + 4 * gcbNodeFields * i;
+
+      Node * node = clad->addNode(gcb.str(stringId(gcb, p, 0)));
+      node->parentName = gcb.str(stringId(gcb, p, 1));
+      node->color = unpackColor(getInt32(p + 8));
+      node->start = unpackDate(getInt32(p + 12));
+      node->stop = unpackDate(getInt32(p + 16));
+      node->iconfile = gcb.str(stringId(gcb, p, 5));
+      node->description = gcb.str(stringId(gcb, p, 6));
+
+      int first = getInt32(p + 28);
+      int count = getInt32(p + 32);
+      if(first < 0 || count < 0 || count > nameChangeCount - first) throw 0;
+      for(int j = first; j < first + count; ++j) {
+        const char * nc = nameChanges + 4 * gcbNameChangeFields * j;
+        node->addNameChange(gcb.str(stringId(gcb, nc, 0)),
+                            unpackDate(getInt32(nc + 4)),
+                            gcb.str(stringId(gcb, nc, 2)));
+      }
+    }
+
+    // Connectors
+    for(int i = 0; i < connectorCount; ++i) {
+      const char * p = connectors + 4 * gcbConnectorFields * i;
+
+      Connector * c = clad->addConnector();
+      c->fromWhen = unpackDate(getInt32(p));
+      c->fromName = gcb.str(stringId(gcb, p, 1));
+      c->toWhen = unpackDate(getInt32(p + 8));
+      c->toName = gcb.str(stringId(gcb, p, 3));
+      c->thickness = getInt32(p + 16);
+      c->color = unpackColor(getInt32(p + 20));
+    }
+
+    // Domains
+    for(int i = 0; i < domainCount; ++i) {
+      const char * p = domains + 4 * gcbDomainFields * i;
+
+      Domain * domain = clad->addDomain(gcb.str(stringId(gcb, p, 0)));
+      domain->color = unpackColor(getInt32(p + 4));
+      domain->intensity = getInt32(p + 8);
+    }
+
+    // Images, SVG first
+    for(int i = 0; i < svgCount + pngCount; ++i) {
+      const char * p = images + 4 * gcbImageFields * i;
+
+      Image * image = clad->addImage(gcb.str(stringId(gcb, p, 0)),
+        (i < svgCount) ? (clad->includeSVG) : (clad->includePNG));
+      image->x = getInt32(p + 4);
+      image->y = getInt32(p + 8);
+    }
+
+  } catch (int) {
+    throw "invalid binary dataset " + in.name;
+  }
+
+}